@@ -4,11 +4,59 @@ namespace MsTimer2 {
 	extern volatile unsigned long count;
 	extern volatile char overflowing;
 	extern volatile unsigned int tcnt2;
+	extern volatile char dynamicTick;
+	extern volatile unsigned char step;
+	extern volatile unsigned long frac;
+	extern unsigned char maxStep;
+	extern volatile unsigned long ticks;
+	extern volatile long trim;
+	extern volatile long trimAcc;
+	extern volatile long trimTotal;
+	extern volatile char ppsStamped;
+	extern volatile unsigned long ppsTicks;
+	extern volatile int ppsSub;
+	extern volatile long ppsTrimTotal;
+	extern unsigned long cpuClock;
 	
 	void set(unsigned long ms, void (*f)());
+	void setDynamicTick(char on);
 	void start();
 	void stop();
+	unsigned long measureClock();
+	unsigned long calibrate(char trimOsccal);
+	void ppsEdge();
+	char discipline();
+	char ppsLocked();
 	void _overflow();
+	void _reload();
+	void _stopAsync();
+	signed char _trimCounts();
+
+#if defined(MSTIMER2_KERNEL)
+	struct task {
+		volatile unsigned int sp;	// saved stack pointer while switched out
+		void (*f)();
+		unsigned char *stack;		// lowest address, 0 for the loop() task
+		unsigned int size;
+		unsigned char priority;		// higher runs first
+		volatile unsigned char state;	// TASK_FREE, TASK_READY or TASK_SLEEPING
+		volatile unsigned long wake;	// ticks value to wake at
+		volatile unsigned long cpu;	// ticks it was running at
+	};
+	extern task tasks[];
+	extern volatile unsigned char current;
+	extern volatile unsigned int _sp;
+
+	char taskCreate(void (*f)(), unsigned char *stack, unsigned int size, unsigned char priority);
+	void taskSleep(unsigned long ms);
+	void taskYield() __attribute__((naked, noinline));
+	unsigned long taskCpu(char id);
+	unsigned int taskStackFree(char id);
+	void _tick();
+	void _tickSwitch() __attribute__((naked, noinline));
+	void _schedule();
+	void _taskEntry();
+#endif
 }
 
 unsigned long MsTimer2::msecs;
@@ -16,6 +64,19 @@ void (*MsTimer2::func)();
 volatile unsigned long MsTimer2::count;
 volatile char MsTimer2::overflowing;
 volatile unsigned int MsTimer2::tcnt2;
+volatile char MsTimer2::dynamicTick;
+volatile unsigned char MsTimer2::step = 1;	// ms covered by the interval in progress
+volatile unsigned long MsTimer2::frac;		// leftover of the interval lengths, in 1/1024000 tick
+unsigned char MsTimer2::maxStep;
+volatile unsigned long MsTimer2::ticks;		// ms since start(), never reset
+volatile long MsTimer2::trim;			// reload correction, in 1/65536 count per ms
+volatile long MsTimer2::trimAcc;
+volatile long MsTimer2::trimTotal;		// counts added by the trim so far
+volatile char MsTimer2::ppsStamped;
+volatile unsigned long MsTimer2::ppsTicks;
+volatile int MsTimer2::ppsSub;
+volatile long MsTimer2::ppsTrimTotal;
+unsigned long MsTimer2::cpuClock = F_CPU;	// measured by calibrate(), used for the reloads
 #if defined(__arm__) && defined(TEENSYDUINO)
 static IntervalTimer itimer;
 #endif
@@ -36,6 +97,7 @@ void MsTimer2::set(unsigned long ms, void (*f)()) {
 	TCCR2B &= ~(1<<WGM22);
 	ASSR &= ~(1<<AS2);
 	TIMSK2 &= ~(1<<OCIE2A);
+	TIFR2 = (1<<TOV2) | (1<<OCF2A) | (1<<OCF2B);	// changing AS2 can set them
 	
 	if ((F_CPU >= 1000000UL) && (F_CPU <= 16000000UL)) {	// prescaler set to 64
 		TCCR2B |= (1<<CS22);
@@ -115,7 +177,7 @@ void MsTimer2::set(unsigned long ms, void (*f)()) {
 		TCCR4B = (1<<CS41) | (1<<PSR4);
 		prescaler = 2.0;
 	}
-	tcnt2 = (int)((float)F_CPU * 0.001 / prescaler) - 1;
+	tcnt2 = (int)((float)cpuClock * 0.001 / prescaler) - 1;
 	OCR4C = tcnt2;
 	return;
 #elif defined(__arm__) && defined(TEENSYDUINO)
@@ -124,14 +186,67 @@ void MsTimer2::set(unsigned long ms, void (*f)()) {
 #error Unsupported CPU type
 #endif
 
-	tcnt2 = 256 - (int)((float)F_CPU * 0.001 / prescaler);
+	tcnt2 = 256 - (int)((float)cpuClock * 0.001 / prescaler);
+	dynamicTick = 0;
+}
+
+// Dynamic tick: instead of interrupting every millisecond, Timer2 runs
+// from the 1024 prescaler and each interval is programmed to cover as many
+// ms as possible (up to maxStep, about 16 ms at 16 MHz) without passing the
+// next callback, so a 1000 ms period takes ~63 interrupts instead of 1000.
+// The callback still runs on time on average, with up to one prescaled
+// tick (64 us at 16 MHz) of jitter. Call after set() and before start();
+// only the Timer2 based chips support it, it's ignored on the others.
+void MsTimer2::setDynamicTick(char on) {
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	if (!on) {
+		set(msecs, func);	// back to the fixed 1 ms tick
+		return;
+	}
+
+	TCCR2B |= (1<<CS22) | (1<<CS21) | (1<<CS20);	// prescaler set to 1024
+
+	// longest interval that fits the 8 bit counter
+	unsigned long longest = 262144000UL / cpuClock;
+	maxStep = longest > 255 ? 255 : (longest < 1 ? 1 : longest);
+	dynamicTick = 1;
+#endif
+}
+
+// program the next interval, up to the next callback, counting from the
+// overflow that just happened
+void MsTimer2::_reload() {
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	unsigned long done = count >= msecs ? count - msecs : count;
+	unsigned long left = msecs - done;
+
+	step = left > maxStep ? maxStep : left;
+
+	// ms * cpuClock / 1024000 ticks, carrying the remainder to the next
+	// interval so no time is lost to the rounding
+	unsigned long need = step * cpuClock + frac;
+	unsigned int ticks = need / 1024000UL;
+	frac = need % 1024000UL;
+
+	// the counter has been running since the overflow
+	unsigned int reload = 256 - ticks + TCNT2;
+	TCNT2 = reload > 255 ? 255 : reload;
+#endif
 }
 
 void MsTimer2::start() {
 	count = 0;
+	ticks = 0;
 	overflowing = 0;
+	step = 1;
 #if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined (__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
-	TCNT2 = tcnt2;
+	if (dynamicTick) {
+		frac = 0;
+		TCNT2 = 0;
+		_reload();
+	} else {
+		TCNT2 = tcnt2;
+	}
 	TIMSK2 |= (1<<TOIE2);
 #elif defined (__AVR_ATmega128__)
 	TCNT2 = tcnt2;
@@ -163,7 +278,12 @@ void MsTimer2::stop() {
 }
 
 void MsTimer2::_overflow() {
-	count += 1;
+	count += step;
+	ticks += step;
+
+	// before the callback gets a chance to delay it
+	if (dynamicTick)
+		_reload();
 	
 	if (count >= msecs && !overflowing) {
 		overflowing = 1;
@@ -174,14 +294,508 @@ void MsTimer2::_overflow() {
 	}
 }
 
+// RC oscillator calibration: boards running from the internal 8 MHz RC
+// oscillator are off by a few %. measureClock() counts CPU cycles on
+// Timer1 against 256 ticks (7.8 ms) of a 32.768 kHz watch crystal on the
+// TOSC pins, with Timer2 in asynchronous mode. calibrate() then either
+// trims OSCCAL to bring the CPU clock as close to F_CPU as it goes, or just
+// keeps the measured frequency in cpuClock so that the periods set() and
+// the dynamic tick program come out right anyway. Call it before set(), it
+// takes Timer2 and (briefly) Timer1 over and keeps interrupts off while it
+// measures, so millis() loses that time. Timer1 gets its registers and
+// count back, but is stopped for those 7.8 ms. The first measurement
+// waits a second for the crystal to start. Timer2 based chips only.
+
+// CPU clock in Hz measured against the 32.768 kHz crystal, 0 if unsupported
+// or if the crystal doesn't tick
+unsigned long MsTimer2::measureClock() {
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	static char crystalStarted;
+	unsigned char tccr1a = TCCR1A, tccr1b = TCCR1B, timsk1 = TIMSK1;
+	unsigned int overflows = 0;
+	unsigned int n = 0;
+	unsigned int tcnt1;
+	unsigned char start;
+
+	// Timer2 counting the crystal, no prescaler
+	TIMSK2 = 0;
+	ASSR |= (1<<AS2);
+	TCCR2A = 0;
+	TCCR2B = (1<<CS20);
+	while (ASSR & ((1<<TCN2UB) | (1<<OCR2AUB) | (1<<OCR2BUB) | (1<<TCR2AUB) | (1<<TCR2BUB)))
+		;
+
+	// the crystal takes up to a second to start and settle
+	if (!crystalStarted) {
+		delay(1000);
+		crystalStarted = 1;
+	}
+
+	noInterrupts();
+
+	// line up with a crystal edge; 65536 turns of the loop are many
+	// crystal ticks at any clock
+	start = TCNT2;
+	while (TCNT2 == start)
+		if (++n == 0) { interrupts(); _stopAsync(); return 0; }
+	start = TCNT2;
+
+	// Timer1 counting CPU cycles
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCCR1B = 0;
+	tcnt1 = TCNT1;
+	TCNT1 = 0;
+	TIFR1 = (1<<TOV1);
+	TCCR1B = (1<<CS10);
+
+	// 256 crystal ticks: wait for TCNT2 to leave start and come back,
+	// giving up if the crystal stops (16 overflows is 1/128 s at 134 MHz)
+	while (TCNT2 == start && overflows < 16)
+		if (TIFR1 & (1<<TOV1)) { TIFR1 = (1<<TOV1); overflows++; }
+	while (TCNT2 != start && overflows < 16)
+		if (TIFR1 & (1<<TOV1)) { TIFR1 = (1<<TOV1); overflows++; }
+
+	TCCR1B = 0;
+	unsigned long cycles = ((unsigned long)overflows << 16) + TCNT1;
+	if (TIFR1 & (1<<TOV1))
+		cycles += 65536UL;
+
+	// Timer1 as it was, restarting from the count it was stopped at
+	TCNT1 = tcnt1;
+	TCCR1A = tccr1a;
+	TIFR1 = (1<<TOV1);
+	TIMSK1 = timsk1;
+	TCCR1B = tccr1b;
+
+	interrupts();
+
+	_stopAsync();
+
+	if (overflows >= 16)
+		return 0;
+
+	// 256 ticks of 32768 Hz is 1/128 s
+	return cycles * 128;
+#else
+	return 0;
+#endif
+}
+
+// stop Timer2 after a measurement, dropping the flags the crystal left so
+// set() and start() don't take an early tick; the crystal keeps running
+void MsTimer2::_stopAsync() {
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	TCCR2B = 0;
+	while (ASSR & (1<<TCR2BUB))
+		;
+	TIFR2 = (1<<TOV2) | (1<<OCF2A) | (1<<OCF2B);
+#endif
+}
+
+// measure the CPU clock and, with trimOsccal, step OSCCAL to bring it as
+// close to F_CPU as possible; returns the resulting clock (also kept in
+// cpuClock), 0 if unsupported
+unsigned long MsTimer2::calibrate(char trimOsccal) {
+	unsigned long f = measureClock();
+
+	if (f == 0)
+		return 0;
+
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	if (trimOsccal) {
+		// OSCCAL is monotonic within each half of its range; stop as soon as
+		// the error grows, one step at a time keeps within the datasheet's
+		// 2% per change limit
+		for (int i = 0; i < 128; i++) {
+			unsigned char cal = OSCCAL;
+			char up = f < F_CPU;
+
+			if ((up && (cal & 0x7F) == 0x7F) || (!up && (cal & 0x7F) == 0))
+				break;
+
+			OSCCAL = up ? cal + 1 : cal - 1;
+			unsigned long g = measureClock();
+
+			if ((g > F_CPU ? g - F_CPU : F_CPU - g) >= (f > F_CPU ? f - F_CPU : F_CPU - f)) {
+				OSCCAL = cal;	// no better than before
+				break;
+			}
+			f = g;
+		}
+	}
+#endif
+
+	cpuClock = f;
+	return f;
+}
+
+// PPS disciplining: ppsEdge() timestamps each edge of an external 1 PPS
+// reference (e.g. a GPS module on an interrupt pin) against the Timer2
+// counter, and discipline() turns the counts measured over each second
+// into trim, a fractional correction of the 1 ms reload that makes the tick
+// follow the reference to a few ppm instead of the crystal or resonator.
+// Without edges the last trim is kept (holdover). Fixed 1 ms tick on the
+// Timer2 based chips only.
+//
+//	attachInterrupt(digitalPinToInterrupt(2), MsTimer2::ppsEdge, RISING);
+//	...
+//	void loop() { MsTimer2::discipline(); }
+
+// call from the PPS pin interrupt
+void MsTimer2::ppsEdge() {
+#if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
+	unsigned char t = TCNT2;
+
+	// a Timer2 overflow waiting behind us has already started the next ms,
+	// counting from 0 rather than tcnt2
+	if ((TIFR2 & (1<<TOV2)) && t < 128) {
+		ppsTicks = ticks + 1;
+		ppsSub = t;
+	} else {
+		ppsTicks = ticks;
+		ppsSub = (int)t - (int)tcnt2;
+	}
+	ppsTrimTotal = trimTotal;
+	ppsStamped = 1;
+#endif
+}
+
+// call from loop(); returns 1 when a new PPS measurement updated the trim
+char MsTimer2::discipline() {
+	static unsigned long lastTicks;
+	static int lastSub;
+	static long lastTrimTotal;
+	static char haveLast;
+	static char tracking;		// last edges were within a ms of the tick
+	static char rejected;		// edges rejected in a row
+	unsigned long t;
+	int sub;
+	long trimmed;
+
+	if (!ppsStamped)
+		return 0;
+
+	noInterrupts();
+	t = ppsTicks;
+	sub = ppsSub;
+	trimmed = ppsTrimTotal;
+	ppsStamped = 0;
+	interrupts();
+
+	long n = 256 - tcnt2;		// counts per ms without trim
+	long ms = t - lastTicks;
+
+	// anything the trim can correct (4 counts per ms) is a real second
+	// until the tick follows the reference, then only +-5 ms; outside
+	// that it is a missed or glitch edge
+	long slack = tracking ? 5 : 4000 / n + 2;
+	char ok = haveLast && ms >= 1000 - slack && ms <= 1000 + slack;
+
+	if (ok) {
+		// counts the timer really ran during the reference second,
+		// against the 1000 ms worth it should have
+		long counts = ms * n + (trimmed - lastTrimTotal) + (sub - lastSub);
+		long target = (counts - 1000 * n) * 65536L / 1000;
+
+		// smooth the +-1 count timestamp noise
+		long next = trim + (target - trim) / 4;
+		if (next > 4L * 65536) next = 4L * 65536;
+		if (next < -4L * 65536) next = -4L * 65536;
+
+		// the tick reads trim every ms, so don't let it see half a store
+		uint8_t oldSREG = SREG;
+		noInterrupts();
+		trim = next;
+		SREG = oldSREG;
+
+		tracking = ms >= 999 && ms <= 1001;
+		rejected = 0;
+	} else if (haveLast && ++rejected >= 2) {
+		// lost it, e.g. the reference came back after a long gap
+		tracking = 0;
+	}
+
+	lastTicks = t;
+	lastSub = sub;
+	lastTrimTotal = trimmed;
+	haveLast = 1;
+
+	return ok;
+}
+
+// 1 if a PPS edge arrived in the last 2 seconds
+char MsTimer2::ppsLocked() {
+	unsigned long t, last;
+
+	noInterrupts();
+	t = ticks;
+	last = ppsTicks;
+	interrupts();
+
+	return last && t - last < 2000;
+}
+
+// counts to add to the next 1 ms interval, from the fractional trim
+signed char MsTimer2::_trimCounts() {
+	trimAcc += trim;
+
+	signed char extra = trimAcc >> 16;
+	trimAcc -= (long)extra << 16;
+	trimTotal += extra;
+
+	return extra;
+}
+
+// Preemptive kernel (compile with MSTIMER2_KERNEL defined): tasks with
+// their own fixed size stacks, switched by priority on the 1 ms tick and
+// whenever one sleeps or yields; equal priorities take turns each tick.
+// loop() is task 0, the lowest priority, and runs when nothing else is
+// ready. A switch saves the 32 registers and SREG on the outgoing task's
+// stack and swaps stack pointers. Interrupt handlers, including the
+// MsTimer2 callback, SimpleTimer polling in loop() and TimerOne
+// callbacks, keep working but run on whatever stack is current, so size
+// every stack for the deepest of them plus ~40 bytes of saved context.
+// taskCpu() counts the ticks each task was running at, taskStackFree()
+// the bytes of its stack never touched. Fixed 1 ms tick, Timer2 based
+// chips only.
+#if defined(MSTIMER2_KERNEL)
+#if !(defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__))
+#error MSTIMER2_KERNEL needs a Timer2 based AVR
+#endif
+
+#ifndef MSTIMER2_TASKS
+#define MSTIMER2_TASKS 4		// besides loop()
+#endif
+
+#define TASK_FREE	0
+#define TASK_READY	1
+#define TASK_SLEEPING	2
+#define TASK_PAINT	0xA5
+
+MsTimer2::task MsTimer2::tasks[MSTIMER2_TASKS + 1] = { { 0, 0, 0, 0, 0, TASK_READY, 0, 0 } };
+volatile unsigned char MsTimer2::current;
+volatile unsigned int MsTimer2::_sp;
+
+// the big parts need RAMPZ and EIND kept per task too
+#if defined(__AVR_HAVE_RAMPZ__) && defined(__AVR_HAVE_EIJMP_EICALL__)
+#define _PUSH_EXT "in r0, 0x3b\n\t" "push r0\n\t" "in r0, 0x3c\n\t" "push r0\n\t"
+#define _POP_EXT "pop r0\n\t" "out 0x3c, r0\n\t" "pop r0\n\t" "out 0x3b, r0\n\t"
+#define _EXT_BYTES 2
+#elif defined(__AVR_HAVE_RAMPZ__)
+#define _PUSH_EXT "in r0, 0x3b\n\t" "push r0\n\t"
+#define _POP_EXT "pop r0\n\t" "out 0x3b, r0\n\t"
+#define _EXT_BYTES 1
+#else
+#define _PUSH_EXT
+#define _POP_EXT
+#define _EXT_BYTES 0
+#endif
+
+// push the context and leave the stack pointer in _sp
+#define _SAVE_CONTEXT() asm volatile ( \
+	"push r0\n\t" \
+	"in r0, __SREG__\n\t" \
+	"cli\n\t" \
+	"push r0\n\t" \
+	_PUSH_EXT \
+	"push r1\n\t" \
+	"clr r1\n\t" \
+	"push r2\n\t" "push r3\n\t" "push r4\n\t" "push r5\n\t" \
+	"push r6\n\t" "push r7\n\t" "push r8\n\t" "push r9\n\t" \
+	"push r10\n\t" "push r11\n\t" "push r12\n\t" "push r13\n\t" \
+	"push r14\n\t" "push r15\n\t" "push r16\n\t" "push r17\n\t" \
+	"push r18\n\t" "push r19\n\t" "push r20\n\t" "push r21\n\t" \
+	"push r22\n\t" "push r23\n\t" "push r24\n\t" "push r25\n\t" \
+	"push r26\n\t" "push r27\n\t" "push r28\n\t" "push r29\n\t" \
+	"push r30\n\t" "push r31\n\t" \
+	"in r0, __SP_L__\n\t" \
+	"sts %[sp], r0\n\t" \
+	"in r0, __SP_H__\n\t" \
+	"sts %[sp]+1, r0\n\t" \
+	:: [sp] "i" (&MsTimer2::_sp))
+
+// switch to the stack pointer in _sp and pop the context found there
+#define _RESTORE_CONTEXT() asm volatile ( \
+	"lds r28, %[sp]\n\t" \
+	"lds r29, %[sp]+1\n\t" \
+	"out __SP_L__, r28\n\t" \
+	"out __SP_H__, r29\n\t" \
+	"pop r31\n\t" "pop r30\n\t" \
+	"pop r29\n\t" "pop r28\n\t" "pop r27\n\t" "pop r26\n\t" \
+	"pop r25\n\t" "pop r24\n\t" "pop r23\n\t" "pop r22\n\t" \
+	"pop r21\n\t" "pop r20\n\t" "pop r19\n\t" "pop r18\n\t" \
+	"pop r17\n\t" "pop r16\n\t" "pop r15\n\t" "pop r14\n\t" \
+	"pop r13\n\t" "pop r12\n\t" "pop r11\n\t" "pop r10\n\t" \
+	"pop r9\n\t" "pop r8\n\t" "pop r7\n\t" "pop r6\n\t" \
+	"pop r5\n\t" "pop r4\n\t" "pop r3\n\t" "pop r2\n\t" \
+	"pop r1\n\t" \
+	_POP_EXT \
+	"pop r0\n\t" \
+	"out __SREG__, r0\n\t" \
+	"pop r0\n\t" \
+	:: [sp] "i" (&MsTimer2::_sp))
+
+// start f as a task on stack[0..size-1]; returns its id, -1 if all the
+// slots are taken. Ready at once, it first runs at the next switch
+char MsTimer2::taskCreate(void (*f)(), unsigned char *stack, unsigned int size, unsigned char priority) {
+	char id = -1;
+
+	for (char i = 1; i <= MSTIMER2_TASKS; i++)
+		if (tasks[(unsigned char)i].state == TASK_FREE) { id = i; break; }
+	if (id < 0)
+		return -1;
+
+	for (unsigned int i = 0; i < size; i++)
+		stack[i] = TASK_PAINT;
+
+	// the frame _RESTORE_CONTEXT() and ret expect, returning into _taskEntry()
+	unsigned char *p = stack + size - 1;
+	unsigned int entry = (uintptr_t)_taskEntry;
+	*p-- = entry & 0xFF;
+	*p-- = entry >> 8;
+#if defined(__AVR_3_BYTE_PC__)
+	*p-- = 0;
+#endif
+	*p-- = 0;			// r0
+	*p-- = 0x80;			// SREG, interrupts on
+	for (unsigned char i = 0; i < _EXT_BYTES + 31; i++)
+		*p-- = 0;		// RAMPZ, EIND, r1-r31
+
+	task &t = tasks[(unsigned char)id];
+	noInterrupts();
+	t.sp = (uintptr_t)p;
+	t.f = f;
+	t.stack = stack;
+	t.size = size;
+	t.priority = priority;
+	t.cpu = 0;
+	t.state = TASK_READY;
+	interrupts();
+	return id;
+}
+
+// runs the task function, then retires the task if it ever returns
+void MsTimer2::_taskEntry() {
+	tasks[current].f();
+	noInterrupts();
+	tasks[current].state = TASK_FREE;
+	taskYield();
+}
+
+// give the CPU to another ready task of at least the same priority
+void MsTimer2::taskYield() {
+	_SAVE_CONTEXT();
+	_schedule();
+	_RESTORE_CONTEXT();
+	asm volatile ("ret");
+}
+
+// block the calling task for ms ticks; loop() can't block, it yields
+// until they have passed instead
+void MsTimer2::taskSleep(unsigned long ms) {
+	uint8_t oldSREG = SREG;
+	unsigned long start, now;
+
+	// ticks is 4 bytes, so only read it with the tick held off
+	noInterrupts();
+	start = ticks;
+	if (current != 0) {
+		tasks[current].wake = start + ms;
+		tasks[current].state = TASK_SLEEPING;
+		taskYield();
+		SREG = oldSREG;
+		return;
+	}
+	SREG = oldSREG;
+
+	for (;;) {
+		noInterrupts();
+		now = ticks;
+		SREG = oldSREG;
+		if (now - start >= ms)
+			return;
+		taskYield();
+	}
+}
+
+// pick the highest priority ready task, taking turns among equals
+// starting after the current one; interrupts are off
+void MsTimer2::_schedule() {
+	unsigned char next = 0;
+	int best = -1;
+
+	tasks[current].sp = _sp;
+	for (unsigned char n = 1; n <= MSTIMER2_TASKS + 1; n++) {
+		unsigned char i = (current + n) % (MSTIMER2_TASKS + 1);
+		if (tasks[i].state == TASK_READY && tasks[i].priority > best) {
+			best = tasks[i].priority;
+			next = i;
+		}
+	}
+	current = next;
+	_sp = tasks[next].sp;
+}
+
+// the 1 ms tick: timer work, CPU accounting, wake ups, then preemption
+void MsTimer2::_tick() {
+	if (!dynamicTick)
+		TCNT2 = trim ? tcnt2 - _trimCounts() : tcnt2;
+	_overflow();
+
+	tasks[current].cpu++;
+	for (unsigned char i = 1; i <= MSTIMER2_TASKS; i++)
+		if (tasks[i].state == TASK_SLEEPING && (long)(ticks - tasks[i].wake) >= 0)
+			tasks[i].state = TASK_READY;
+	_schedule();
+}
+
+// called from the naked tick ISR, whose reti it returns to, so the frame
+// is the same one taskYield() leaves
+void MsTimer2::_tickSwitch() {
+	_SAVE_CONTEXT();
+	_tick();
+	_RESTORE_CONTEXT();
+	asm volatile ("ret");
+}
+
+unsigned long MsTimer2::taskCpu(char id) {
+	unsigned long c;
+
+	noInterrupts();
+	c = tasks[(unsigned char)id].cpu;
+	interrupts();
+	return c;
+}
+
+// bytes at the bottom of the stack still holding the paint; 0 for loop()
+unsigned int MsTimer2::taskStackFree(char id) {
+	task &t = tasks[(unsigned char)id];
+	unsigned int n = 0;
+
+	if (!t.stack)
+		return 0;
+	while (n < t.size && t.stack[n] == TASK_PAINT)
+		n++;
+	return n;
+}
+#endif // MSTIMER2_KERNEL
+
 #if defined (__AVR__)
+#if defined(MSTIMER2_KERNEL)
+ISR(TIMER2_OVF_vect, ISR_NAKED) {
+	MsTimer2::_tickSwitch();
+	reti();
+}
+#else
 #if defined (__AVR_ATmega32U4__)
 ISR(TIMER4_OVF_vect) {
 #else
 ISR(TIMER2_OVF_vect) {
 #endif
 #if defined (__AVR_ATmega168__) || defined (__AVR_ATmega48__) || defined (__AVR_ATmega88__) || defined (__AVR_ATmega328P__) || defined (__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
-	TCNT2 = MsTimer2::tcnt2;
+	if (!MsTimer2::dynamicTick)	// _overflow() reloads it in dynamic tick mode
+		TCNT2 = MsTimer2::trim ? MsTimer2::tcnt2 - MsTimer2::_trimCounts() : MsTimer2::tcnt2;
 #elif defined (__AVR_ATmega128__)
 	TCNT2 = MsTimer2::tcnt2;
 #elif defined (__AVR_ATmega8__)
@@ -191,8 +805,61 @@ ISR(TIMER2_OVF_vect) {
 #endif
 	MsTimer2::_overflow();
 }
+#endif // MSTIMER2_KERNEL
 #endif // AVR
 
+// Vertical counter debouncer for up to 8, 16 or 32 inputs at once
+// (T = uint8_t, uint16_t or uint32_t): bit i of every variable belongs to
+// input i, so one sample() call debounces all of them with a handful of
+// bitwise operations. An input has to read the same 4 samples in a row
+// before its state changes. Call sample() from the MsTimer2 callback (or a
+// SimpleTimer one) with whole ports, e.g. sample(PIND) or
+// sample(((uint16_t)PINB << 8) | PIND).
+template <typename T>
+class Debouncer {
+public:
+	Debouncer(T initial = 0) : debounced(initial), cnt0(0), cnt1(0), changes(0) {}
+
+	// feed one raw sample of the inputs
+	void sample(T raw) {
+		T delta = raw ^ debounced;
+
+		// 2 bit counters, reset wherever the input agrees with the state
+		cnt1 = (cnt1 ^ cnt0) & delta;
+		cnt0 = ~cnt0 & delta;
+
+		// counters that rolled over: the input has been stable long enough
+		T toggle = delta & ~(cnt0 | cnt1);
+		debounced ^= toggle;
+		changes |= toggle;
+	}
+
+	// debounced state of the inputs
+	T state() {
+		T s;
+		noInterrupts();
+		s = debounced;
+		interrupts();
+		return s;
+	}
+
+	// inputs whose debounced state changed since the last call
+	// (AND with state() for the ones that went high)
+	T changed() {
+		T c;
+		noInterrupts();
+		c = changes;
+		changes = 0;
+		interrupts();
+		return c;
+	}
+
+private:
+	volatile T debounced;
+	volatile T cnt0, cnt1;
+	volatile T changes;
+};
+
 ////////////////////////////////////////////////////
 
 int led = 13;
@@ -1,5 +1,19 @@
+// uncomment to build saveTimers()/restoreTimers(), which need the EEPROM library
+//#define SIMPLETIMER_EEPROM
+#if defined(SIMPLETIMER_EEPROM)
+#include <EEPROM.h>
+#endif
+ 
 typedef void (*timer_callback)(void);
  
+// callback that reschedules itself: returns the delay until its next
+// call (measured from when it was due), or a negative value to stop
+typedef long (*timer_callback_next)(void);
+ 
+// called by run() right before a timer's callback, with the slot
+// number and the elapsed() value the timer was due at
+typedef void (*timer_fire_hook)(int numTimer, unsigned long due);
+ 
 class SimpleTimer {
  
 public:
@@ -10,6 +24,33 @@ public:
     const static int RUN_FOREVER = 0;
     const static int RUN_ONCE = 1;
  
+#if defined(SIMPLETIMER_EEPROM)
+    // restoreTimers() catch-up policies for deadlines that passed while down
+    const static int CATCHUP_ALL = 0;       // run every missed period, back to back
+    const static int CATCHUP_ONCE = 1;      // run overdue timers once, then keep their phase
+    const static int CATCHUP_SKIP = 2;      // drop missed periods, keep the phase
+#endif
+ 
+    // number of commands armFromISR()/cancelFromISR() can queue between
+    // two run() calls (a power of two)
+    const static int ISR_QUEUE_SIZE = 4;
+ 
+    // number of log2 buckets in the timer_stats histograms
+    const static int STATS_BUCKETS = 10;
+ 
+    // what run() has been doing since the last resetStats();
+    // histogram bucket 0 counts 0, bucket b counts 2^(b-1) .. 2^b - 1,
+    // and the last bucket everything above
+    struct timer_stats {
+        uint32_t window;                        // elapsed() time covered by the counters
+        uint32_t fires;                         // callbacks run
+        uint32_t missed;                        // fires more than a period late
+        uint16_t lateness[STATS_BUCKETS];       // fires by lateness, in elapsed() units
+        uint16_t callbackTime[STATS_BUCKETS];   // callbacks by run time, in microseconds
+        uint8_t active;                         // timers in use
+        uint8_t peak;                           // most timers ever in use at once
+    };
+ 
     // constructor
     SimpleTimer();
  
@@ -25,10 +66,37 @@ public:
     // call function f every d milliseconds for n times
     int setTimer(long d, timer_callback f, int n);
  
+    // call function f after d milliseconds, then after whatever delay it
+    // returns, for n times
+    int setTimer(long d, timer_callback_next f, int n);
+ 
+    // call function f after d milliseconds, then after whatever delay it
+    // returns, until it returns a negative value
+    int setInterval(long d, timer_callback_next f);
+ 
+    // call function f once when elapsed() reaches t
+    int setTimerAt(unsigned long t, timer_callback f);
+ 
+    // call function f every d milliseconds, at the times that are offset
+    // milliseconds past a multiple of d (e.g. d = 100, offset = 0 fires at
+    // ...100, ...200, ...) so timers on several boards run in lockstep.
+    // N.B.: since 2^32 is rarely a multiple of d, the alignment shifts once
+    // when millis() wraps
+    int setAlignedInterval(long d, timer_callback f, long offset = 0);
+ 
+    // change the delay of the specified timer in place; the next call is
+    // d milliseconds after the start of the current period
+    void changeInterval(int numTimer, long d);
+ 
+    // set the number of runs the specified timer has left
+    // (RUN_FOREVER to run it forever)
+    void setRemainingRuns(int numTimer, int n);
+ 
     // destroy the specified timer
     void deleteTimer(int numTimer);
  
     // restart the specified timer
+    // (aligned timers skip to their next aligned time instead)
     void restartTimer(int numTimer);
  
     // returns true if the specified timer is enabled
@@ -44,12 +112,79 @@ public:
     // and vice-versa
     void toggle(int numTimer);
  
+    // make the specified timer a member of groups, a mask of up to 8 groups
+    // (bit g set == member of group g); new timers are in no group
+    void setGroups(int numTimer, uint8_t groups);
+ 
+    // returns the group mask of the specified timer
+    uint8_t getGroups(int numTimer);
+ 
+    // pause every timer in one of the groups in mask; paused timers are
+    // skipped by run() altogether until their groups are resumed
+    void pauseGroups(uint8_t mask);
+ 
+    // resume the groups in mask; with shift the deadlines move by the time
+    // spent paused, so timers keep their remaining time, otherwise they
+    // keep their phase and the periods missed while paused are dropped
+    void resumeGroups(uint8_t mask, boolean shift = false);
+ 
+    // destroy every timer in one of the groups in mask
+    void deleteGroups(uint8_t mask);
+ 
     // returns the number of used timers
     int getNumTimers();
  
     // returns the number of available timers
     int getNumAvailableTimers() { return MAX_TIMERS - numTimers; };
  
+    // returns the time left until the next timer is due,
+    // 0 if one is already due, -1 if no timers are in use (or all paused)
+    long getTimeToNextTimer();
+ 
+#if defined(SIMPLETIMER_EEPROM)
+    // save the timer table to EEPROM at address addr; callbacks are stored
+    // as their index in registry so the table survives a reflash as long as
+    // the registry order is kept (timer_callback_next functions go in the
+    // registry cast to timer_callback). Returns the number of timers saved,
+    // timers whose callback isn't in registry are not saved
+    int saveTimers(int addr, const timer_callback registry[], int registrySize);
+ 
+    // replace the timer table with the one saved at addr, shifting deadlines
+    // by downtime (the milliseconds spent powered down, 0 if unknown) and
+    // applying policy to the ones that passed. Timers keep their slot numbers.
+    // Returns the number of timers restored, -1 if no table is saved at addr
+    int restoreTimers(int addr, const timer_callback registry[], int registrySize,
+                      unsigned long downtime, int policy);
+#endif
+ 
+    // ISR-safe versions of setTimer()/deleteTimer(): the command is queued
+    // and carried out at the start of the next run(), the delay counting
+    // from the call. Only call them from ISRs (or with interrupts off), as
+    // they assume a single producer. Return false if the queue is full
+    boolean armFromISR(long d, timer_callback f, int n = RUN_ONCE);
+    boolean cancelFromISR(int numTimer);
+ 
+    // ISR-safe removal of all the timers calling f, for when the ISR doesn't
+    // know the timer number
+    boolean cancelFromISR(timer_callback f);
+ 
+    // copy the statistics into s; cheap enough to call from a callback
+    void getStats(timer_stats &s);
+ 
+    // start a new statistics window (the peak is kept)
+    void resetStats();
+ 
+    // write s to p (e.g. Serial) as a compact little endian binary record,
+    // returns the number of bytes written
+    static size_t writeStats(Print &p, const timer_stats &s);
+ 
+    // write s to p as "name value" text lines, one metric per line
+    static size_t printStats(Print &p, const timer_stats &s);
+ 
+    // install a function called before every callback (0 to remove),
+    // e.g. to log or check the time each timer fires at
+    void setFireHook(timer_fire_hook h) { fireHook = h; };
+ 
 private:
     // deferred call constants
     const static int DEFCALL_DONTRUN = 0;       // don't call the callback function
@@ -59,48 +194,152 @@ private:
     // find the first available slot
     int findFirstFreeSlot();
  
-    // value returned by the millis() function
-    // in the previous run() call
-    unsigned long prev_millis[MAX_TIMERS];
- 
-    // pointers to the callback functions
-    timer_callback callbacks[MAX_TIMERS];
- 
-    // delay values
-    long delays[MAX_TIMERS];
+    // call the callback of the specified timer, updating the statistics
+    void callTimer(int numTimer);
+ 
+    // carry out the commands queued by armFromISR()/cancelFromISR()
+    void drainISRQueue();
+ 
+    // all the state of one timer, kept together in a single record so
+    // run() walks one contiguous array instead of seven parallel ones
+    struct timer_record {
+        // elapsed() value at which the timer is due next
+        unsigned long deadline;
+ 
+        // delay value
+        long delay;
+ 
+        // pointer to the callback function
+        timer_callback callback;
+ 
+        // number of runs to be executed
+        int maxNumRuns;
+ 
+        // number of executed runs
+        int numRuns;
+ 
+        // whether the timer is enabled
+        unsigned char enabled : 1;
+ 
+        // deferred function call (sort of) - N.B.: this field is only used in run()
+        unsigned char toBeCalled : 2;
+ 
+        // callback is really a timer_callback_next
+        unsigned char returnsDelay : 1;
+ 
+        // set by setAlignedInterval(), deadlines stay on the same phase
+        unsigned char aligned : 1;
+ 
+        // groups the timer belongs to, see setGroups()
+        uint8_t groups;
+ 
+        // elapsed() value the timer was paused at, while one of its
+        // groups is paused
+        unsigned long pausedSince;
+    };
+ 
+    timer_record timers[MAX_TIMERS];
+ 
+    // single producer, single consumer command queue from ISRs to run();
+    // isrHead is only written by the ISRs and isrTail only by run(), so
+    // neither side ever has to disable interrupts
+    const static uint8_t ISRCMD_ARM = 0;
+    const static uint8_t ISRCMD_CANCEL = 1;
+    const static uint8_t ISRCMD_CANCEL_CALLBACK = 2;
+ 
+    struct isr_command {
+        uint8_t op;
+        int arg;                    // timer number, number of runs for ISRCMD_ARM
+        long delay;
+        unsigned long stamp;        // elapsed() value when the command was posted
+        timer_callback callback;
+    };
+ 
+    isr_command isrQueue[ISR_QUEUE_SIZE];
+    volatile uint8_t isrHead;
+    volatile uint8_t isrTail;
+ 
+    // queue c for drainISRQueue(), return false if the queue is full
+    boolean postFromISR(const isr_command &c);
+ 
+#if defined(SIMPLETIMER_EEPROM)
+    // EEPROM layout used by saveTimers()/restoreTimers(): fixed width fields,
+    // whole bytes and no pointers, so it doesn't depend on the build that
+    // wrote it. Bump SAVED_VERSION whenever saved_record changes, so tables
+    // in the old layout are rejected rather than misread
+    const static uint16_t SAVED_MAGIC = 0x5354;     // "ST"
+    const static uint8_t SAVED_VERSION = 2;
+ 
+    struct saved_header {
+        uint16_t magic;
+        uint8_t count;              // number of saved_record entries following
+        uint8_t version;            // SAVED_VERSION
+        uint32_t savedAt;           // elapsed() value when the table was saved
+    };
+ 
+    struct saved_record {
+        uint32_t deadline;          // absolute, on the clock of savedAt
+        int32_t delay;
+        int16_t maxNumRuns;
+        int16_t numRuns;
+        uint8_t slot;
+        uint8_t callback;           // index in the registry
+        uint8_t enabled;
+        uint8_t returnsDelay;
+        uint8_t aligned;
+        uint8_t groups;
+    };
+#endif
  
-    // number of runs to be executed for each timer
-    int maxNumRuns[MAX_TIMERS];
- 
-    // number of executed runs for each timer
-    int numRuns[MAX_TIMERS];
+    // actual number of timers in use
+    int numTimers;
  
-    // which timers are enabled
-    boolean enabled[MAX_TIMERS];
+    // groups paused by pauseGroups()
+    uint8_t pausedGroups;
  
-    // deferred function call (sort of) - N.B.: this array is only used in run()
-    int toBeCalled[MAX_TIMERS];
+    // called before each callback, if set
+    timer_fire_hook fireHook;
  
-    // actual number of timers in use
-    int numTimers;
+    // statistics (active is only filled in by getStats())
+    timer_stats stats;
+    unsigned long statsStart;
 };
 
 // Select time function:
 //static inline unsigned long elapsed() { return micros(); }
+//#define SIMPLETIMER_SIMULATE
+#if defined(SIMPLETIMER_SIMULATE)
+// Discrete-event simulation: time doesn't tick, it jumps straight to the
+// next deadline in simAdvance(), so weeks of timer activity (including the
+// 49.7 day millis() wrap) run as fast as the callbacks themselves.
+static unsigned long sim_millis = 0;
+static inline unsigned long elapsed() { return sim_millis; }
+#else
 static inline unsigned long elapsed() { return millis(); }
+#endif
  
  
 SimpleTimer::SimpleTimer() {
     unsigned long current_millis = elapsed();
  
     for (int i = 0; i < MAX_TIMERS; i++) {
-        enabled[i] = false;
-        callbacks[i] = 0;                   // if the callback pointer is zero, the slot is free, i.e. doesn't "contain" any timer
-        prev_millis[i] = current_millis;
-        numRuns[i] = 0;
+        timers[i].enabled = false;
+        timers[i].callback = 0;             // if the callback pointer is zero, the slot is free, i.e. doesn't "contain" any timer
+        timers[i].deadline = current_millis;
+        timers[i].delay = 0;
+        timers[i].numRuns = 0;
+        timers[i].toBeCalled = DEFCALL_DONTRUN;
     }
  
     numTimers = 0;
+    fireHook = 0;
+    pausedGroups = 0;
+ 
+    isrHead = 0;
+    isrTail = 0;
+ 
+    stats.peak = 0;
+    resetStats();
 }
  
  
@@ -108,40 +347,54 @@ void SimpleTimer::run() {
     int i;
     unsigned long current_millis;
  
+    // timers armed or cancelled by ISRs since the last call
+    if (isrHead != isrTail) {
+        drainISRQueue();
+    }
+ 
     // get current time
     current_millis = elapsed();
  
     for (i = 0; i < MAX_TIMERS; i++) {
+        timer_record &t = timers[i];
  
-        toBeCalled[i] = DEFCALL_DONTRUN;
+        t.toBeCalled = DEFCALL_DONTRUN;
  
-        // no callback == no timer, i.e. jump over empty slots
-        if (callbacks[i]) {
+        // no callback == no timer, i.e. jump over empty slots,
+        // and over the timers of paused groups
+        if (t.callback && !(t.groups & pausedGroups)) {
  
             // is it time to process this timer ?
             // see https://arduino.cc/forum/index.php/topic,124048.msg932592.html#msg932592
+            // (the signed difference keeps working across the millis() wrap)
  
-            if (current_millis - prev_millis[i] >= delays[i]) {
+            if ((long)(current_millis - t.deadline) >= 0) {
  
                 // update time
-                //prev_millis[i] = current_millis;
-                prev_millis[i] += delays[i];
+                t.deadline += t.delay;
+ 
+                // past the next deadline too, i.e. run() is more than a
+                // period behind; zero delay timers are due on every call
+                // and disabled ones don't run, so neither can miss one
+                if (t.enabled && t.delay > 0 && (long)(current_millis - t.deadline) > 0) {
+                    stats.missed++;
+                }
  
                 // check if the timer callback has to be executed
-                if (enabled[i]) {
+                if (t.enabled) {
  
                     // "run forever" timers must always be executed
-                    if (maxNumRuns[i] == RUN_FOREVER) {
-                        toBeCalled[i] = DEFCALL_RUNONLY;
+                    if (t.maxNumRuns == RUN_FOREVER) {
+                        t.toBeCalled = DEFCALL_RUNONLY;
                     }
                     // other timers get executed the specified number of times
-                    else if (numRuns[i] < maxNumRuns[i]) {
-                        toBeCalled[i] = DEFCALL_RUNONLY;
-                        numRuns[i]++;
+                    else if (t.numRuns < t.maxNumRuns) {
+                        t.toBeCalled = DEFCALL_RUNONLY;
+                        t.numRuns++;
  
                         // after the last run, delete the timer
-                        if (numRuns[i] >= maxNumRuns[i]) {
-                            toBeCalled[i] = DEFCALL_RUNANDDEL;
+                        if (t.numRuns >= t.maxNumRuns) {
+                            t.toBeCalled = DEFCALL_RUNANDDEL;
                         }
                     }
                 }
@@ -150,16 +403,16 @@ void SimpleTimer::run() {
     }
  
     for (i = 0; i < MAX_TIMERS; i++) {
-        switch(toBeCalled[i]) {
+        switch(timers[i].toBeCalled) {
             case DEFCALL_DONTRUN:
                 break;
  
             case DEFCALL_RUNONLY:
-                (*callbacks[i])();
+                callTimer(i);
                 break;
  
             case DEFCALL_RUNANDDEL:
-                (*callbacks[i])();
+                callTimer(i);
                 deleteTimer(i);
                 break;
         }
@@ -167,6 +420,154 @@ void SimpleTimer::run() {
 }
  
  
+boolean SimpleTimer::postFromISR(const isr_command &c) {
+    uint8_t head = isrHead;
+ 
+    if ((uint8_t)(head - isrTail) >= ISR_QUEUE_SIZE) {
+        return false;
+    }
+ 
+    isrQueue[head & (ISR_QUEUE_SIZE - 1)] = c;
+ 
+    // the command has to be in place before run() can see the new head
+    asm volatile("" ::: "memory");
+    isrHead = head + 1;
+ 
+    return true;
+}
+ 
+ 
+boolean SimpleTimer::armFromISR(long d, timer_callback f, int n) {
+    isr_command c;
+ 
+    if (f == NULL) {
+        return false;
+    }
+ 
+    c.op = ISRCMD_ARM;
+    c.arg = n;
+    c.delay = d;
+    c.stamp = elapsed();
+    c.callback = f;
+ 
+    return postFromISR(c);
+}
+ 
+ 
+boolean SimpleTimer::cancelFromISR(int numTimer) {
+    isr_command c;
+ 
+    c.op = ISRCMD_CANCEL;
+    c.arg = numTimer;
+    c.callback = 0;
+ 
+    return postFromISR(c);
+}
+ 
+ 
+boolean SimpleTimer::cancelFromISR(timer_callback f) {
+    isr_command c;
+ 
+    c.op = ISRCMD_CANCEL_CALLBACK;
+    c.arg = -1;
+    c.callback = f;
+ 
+    return postFromISR(c);
+}
+ 
+ 
+void SimpleTimer::drainISRQueue() {
+    uint8_t tail = isrTail;
+ 
+    while (tail != isrHead) {
+        // read the command before handing its entry back to the ISRs
+        isr_command c = isrQueue[tail & (ISR_QUEUE_SIZE - 1)];
+        asm volatile("" ::: "memory");
+        isrTail = ++tail;
+ 
+        switch (c.op) {
+            case ISRCMD_ARM: {
+                int timerId = setTimer(c.delay, c.callback, c.arg);
+ 
+                // count from when the ISR ran, not from now
+                if (timerId >= 0) {
+                    timers[timerId].deadline = c.stamp + c.delay;
+                }
+                break;
+            }
+ 
+            case ISRCMD_CANCEL:
+                deleteTimer(c.arg);
+                break;
+ 
+            case ISRCMD_CANCEL_CALLBACK:
+                for (int i = 0; i < MAX_TIMERS; i++) {
+                    if (timers[i].callback == c.callback) {
+                        deleteTimer(i);
+                    }
+                }
+                break;
+        }
+    }
+}
+ 
+ 
+// log2 histogram bucket of v, see timer_stats
+static uint8_t statsBucket(unsigned long v) {
+    uint8_t b = 0;
+ 
+    while (v && b < SimpleTimer::STATS_BUCKETS - 1) {
+        v >>= 1;
+        b++;
+    }
+ 
+    return b;
+}
+ 
+ 
+// saturating histogram increment
+static void statsCount(uint16_t *histogram, unsigned long v) {
+    uint8_t b = statsBucket(v);
+ 
+    if (histogram[b] != 0xFFFF) {
+        histogram[b]++;
+    }
+}
+ 
+ 
+void SimpleTimer::callTimer(int numTimer) {
+    unsigned long due = timers[numTimer].deadline - timers[numTimer].delay;
+    unsigned long started;
+ 
+    if (fireHook) {
+        (*fireHook)(numTimer, due);
+    }
+ 
+    stats.fires++;
+    statsCount(stats.lateness, elapsed() - due);
+ 
+    started = micros();
+    if (timers[numTimer].returnsDelay) {
+        long d = (*(timer_callback_next)timers[numTimer].callback)();
+ 
+        // the callback may have deleted or replaced its own timer
+        if (timers[numTimer].callback && timers[numTimer].returnsDelay) {
+            if (d < 0) {
+                deleteTimer(numTimer);
+            }
+            else {
+                timers[numTimer].deadline = due + d;
+                timers[numTimer].delay = d;
+            }
+        }
+    }
+    else {
+        (*timers[numTimer].callback)();
+    }
+    statsCount(stats.callbackTime, micros() - started);
+}
+ 
+ 
 // find the first available slot
 // return -1 if none found
 int SimpleTimer::findFirstFreeSlot() {
@@ -179,7 +580,7 @@ int SimpleTimer::findFirstFreeSlot() {
  
     // return the first slot with no callback (i.e. free)
     for (i = 0; i < MAX_TIMERS; i++) {
-        if (callbacks[i] == 0) {
+        if (timers[i].callback == 0) {
             return i;
         }
     }
@@ -189,6 +590,14 @@ int SimpleTimer::findFirstFreeSlot() {
 }
  
  
+// the first time at or after now that is offset past a multiple of d
+static unsigned long nextAligned(unsigned long now, long d, long offset) {
+    unsigned long phase = (now - offset) % d;
+ 
+    return phase ? now + (d - phase) : now;
+}
+ 
+ 
 int SimpleTimer::setTimer(long d, timer_callback f, int n) {
     int freeTimer;
  
@@ -201,23 +610,47 @@ int SimpleTimer::setTimer(long d, timer_callback f, int n) {
         return -1;
     }
  
-    delays[freeTimer] = d;
-    callbacks[freeTimer] = f;
-    maxNumRuns[freeTimer] = n;
-    enabled[freeTimer] = true;
-    prev_millis[freeTimer] = elapsed();
+    timer_record &t = timers[freeTimer];
+    t.delay = d;
+    t.callback = f;
+    t.maxNumRuns = n;
+    t.numRuns = 0;
+    t.enabled = true;
+    t.returnsDelay = false;
+    t.aligned = false;
+    t.groups = 0;
+    t.deadline = elapsed() + d;
  
     numTimers++;
+    if (numTimers > stats.peak) {
+        stats.peak = numTimers;
+    }
  
     return freeTimer;
 }
  
  
+int SimpleTimer::setTimer(long d, timer_callback_next f, int n) {
+    int timerId = setTimer(d, (timer_callback)f, n);
+ 
+    if (timerId >= 0) {
+        timers[timerId].returnsDelay = true;
+    }
+ 
+    return timerId;
+}
+ 
+ 
 int SimpleTimer::setInterval(long d, timer_callback f) {
     return setTimer(d, f, RUN_FOREVER);
 }
  
  
+int SimpleTimer::setInterval(long d, timer_callback_next f) {
+    return setTimer(d, f, RUN_FOREVER);
+}
+ 
+ 
 int SimpleTimer::setTimeout(long d, timer_callback f) {
     return setTimer(d, f, RUN_ONCE);
 }
@@ -235,12 +668,13 @@ void SimpleTimer::deleteTimer(int timerId) {
  
     // don't decrease the number of timers if the
     // specified slot is already empty
-    if (callbacks[timerId] != NULL) {
-        callbacks[timerId] = 0;
-        enabled[timerId] = false;
-        toBeCalled[timerId] = DEFCALL_DONTRUN;
-        delays[timerId] = 0;
-        numRuns[timerId] = 0;
+    if (timers[timerId].callback != NULL) {
+        timer_record &t = timers[timerId];
+        t.callback = 0;
+        t.enabled = false;
+        t.toBeCalled = DEFCALL_DONTRUN;
+        t.delay = 0;
+        t.numRuns = 0;
  
         // update number of timers
         numTimers--;
@@ -254,7 +688,75 @@ void SimpleTimer::restartTimer(int numTimer) {
         return;
     }
  
-    prev_millis[numTimer] = elapsed();
+    timer_record &t = timers[numTimer];
+ 
+    if (t.aligned && t.delay > 0) {
+        // the current deadline carries the phase
+        t.deadline = nextAligned(elapsed(), t.delay, t.deadline % t.delay);
+    }
+    else {
+        t.deadline = elapsed() + t.delay;
+    }
+}
+ 
+ 
+int SimpleTimer::setTimerAt(unsigned long t, timer_callback f) {
+    long d = (long)(t - elapsed());
+    int timerId;
+ 
+    // already passed: call it on the next run()
+    if (d < 0) {
+        d = 0;
+    }
+ 
+    timerId = setTimer(d, f, RUN_ONCE);
+    if (timerId >= 0) {
+        timers[timerId].deadline = t;
+    }
+ 
+    return timerId;
+}
+ 
+ 
+int SimpleTimer::setAlignedInterval(long d, timer_callback f, long offset) {
+    int timerId;
+ 
+    if (d <= 0) {
+        return -1;
+    }
+ 
+    timerId = setTimer(d, f, RUN_FOREVER);
+    if (timerId >= 0) {
+        timers[timerId].deadline = nextAligned(elapsed(), d, offset);
+        timers[timerId].aligned = true;
+    }
+ 
+    return timerId;
+}
+ 
+ 
+void SimpleTimer::changeInterval(int numTimer, long d) {
+    if (numTimer >= MAX_TIMERS || timers[numTimer].callback == 0) {
+        return;
+    }
+ 
+    // keep the start of the current period, i.e. the phase
+    timers[numTimer].deadline += d - timers[numTimer].delay;
+    timers[numTimer].delay = d;
+}
+ 
+ 
+void SimpleTimer::setRemainingRuns(int numTimer, int n) {
+    if (numTimer >= MAX_TIMERS || timers[numTimer].callback == 0) {
+        return;
+    }
+ 
+    if (n == RUN_FOREVER) {
+        timers[numTimer].maxNumRuns = RUN_FOREVER;
+    }
+    else {
+        timers[numTimer].maxNumRuns = timers[numTimer].numRuns + n;
+    }
 }
  
  
@@ -263,7 +765,7 @@ boolean SimpleTimer::isEnabled(int numTimer) {
         return false;
     }
  
-    return enabled[numTimer];
+    return timers[numTimer].enabled;
 }
  
  
@@ -272,7 +774,7 @@ void SimpleTimer::enable(int numTimer) {
         return;
     }
  
-    enabled[numTimer] = true;
+    timers[numTimer].enabled = true;
 }
  
  
@@ -281,7 +783,7 @@ void SimpleTimer::disable(int numTimer) {
         return;
     }
  
-    enabled[numTimer] = false;
+    timers[numTimer].enabled = false;
 }
  
  
@@ -290,16 +792,547 @@ void SimpleTimer::toggle(int numTimer) {
         return;
     }
  
-    enabled[numTimer] = !enabled[numTimer];
+    timers[numTimer].enabled = !timers[numTimer].enabled;
+}
+ 
+ 
+void SimpleTimer::setGroups(int numTimer, uint8_t groups) {
+    if (numTimer >= MAX_TIMERS) {
+        return;
+    }
+ 
+    timer_record &t = timers[numTimer];
+ 
+    // joining a paused group pauses the timer from now on
+    if (!(t.groups & pausedGroups) && (groups & pausedGroups)) {
+        t.pausedSince = elapsed();
+    }
+    t.groups = groups;
+}
+ 
+ 
+uint8_t SimpleTimer::getGroups(int numTimer) {
+    if (numTimer >= MAX_TIMERS) {
+        return 0;
+    }
+ 
+    return timers[numTimer].groups;
+}
+ 
+ 
+void SimpleTimer::pauseGroups(uint8_t mask) {
+    unsigned long current_millis = elapsed();
+ 
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        timer_record &t = timers[i];
+ 
+        // only the timers that weren't paused already
+        if (t.callback && (t.groups & mask) && !(t.groups & pausedGroups)) {
+            t.pausedSince = current_millis;
+        }
+    }
+ 
+    pausedGroups |= mask;
+}
+ 
+ 
+void SimpleTimer::resumeGroups(uint8_t mask, boolean shift) {
+    unsigned long current_millis = elapsed();
+    uint8_t resumed = mask & pausedGroups;
+ 
+    if (!resumed) {
+        return;
+    }
+ 
+    pausedGroups &= ~resumed;
+ 
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        timer_record &t = timers[i];
+ 
+        // only the timers that are running again
+        if (!t.callback || !(t.groups & resumed) || (t.groups & pausedGroups)) {
+            continue;
+        }
+ 
+        if (shift) {
+            // paused since its first group was
+            t.deadline += current_millis - t.pausedSince;
+        }
+        else if (t.delay > 0 && (long)(current_millis - t.deadline) > 0) {
+            // next deadline on the same phase
+            t.deadline += ((current_millis - t.deadline) / t.delay + 1) * t.delay;
+        }
+    }
+}
+ 
+ 
+void SimpleTimer::deleteGroups(uint8_t mask) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].callback && (timers[i].groups & mask)) {
+            deleteTimer(i);
+        }
+    }
 }
  
  
 int SimpleTimer::getNumTimers() {
     return numTimers;
 }
+ 
+ 
+long SimpleTimer::getTimeToNextTimer() {
+    unsigned long current_millis = elapsed();
+    long next = -1;
+ 
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].callback && !(timers[i].groups & pausedGroups)) {
+            long left = (long)(timers[i].deadline - current_millis);
+ 
+            if (left < 0) {
+                left = 0;
+            }
+            if (next < 0 || left < next) {
+                next = left;
+            }
+        }
+    }
+ 
+    return next;
+}
+ 
+ 
+#if defined(SIMPLETIMER_EEPROM)
+int SimpleTimer::saveTimers(int addr, const timer_callback registry[], int registrySize) {
+    saved_header h;
+    int a = addr + sizeof(saved_header);
+ 
+    h.magic = SAVED_MAGIC;
+    h.count = 0;
+    h.version = SAVED_VERSION;
+    h.savedAt = elapsed();
+ 
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        int cb;
+ 
+        if (timers[i].callback == 0) {
+            continue;
+        }
+ 
+        // look the callback up in the registry
+        for (cb = 0; cb < registrySize; cb++) {
+            if (registry[cb] == timers[i].callback) {
+                break;
+            }
+        }
+        if (cb >= registrySize) {
+            continue;
+        }
+ 
+        saved_record r;
+        r.deadline = timers[i].deadline;
+        r.delay = timers[i].delay;
+        r.maxNumRuns = timers[i].maxNumRuns;
+        r.numRuns = timers[i].numRuns;
+        r.slot = i;
+        r.callback = cb;
+        r.enabled = timers[i].enabled;
+        r.returnsDelay = timers[i].returnsDelay;
+        r.aligned = timers[i].aligned;
+        r.groups = timers[i].groups;
+ 
+        // EEPROM.put() only writes the bytes that changed
+        EEPROM.put(a, r);
+        a += sizeof(saved_record);
+        h.count++;
+    }
+ 
+    // header last, so an interrupted save leaves the old count in place
+    EEPROM.put(addr, h);
+ 
+    return h.count;
+}
+ 
+ 
+int SimpleTimer::restoreTimers(int addr, const timer_callback registry[], int registrySize,
+                               unsigned long downtime, int policy) {
+    saved_header h;
+    unsigned long current_millis = elapsed();
+    int a = addr + sizeof(saved_header);
+ 
+    EEPROM.get(addr, h);
+    if (h.magic != SAVED_MAGIC || h.version != SAVED_VERSION || h.count > MAX_TIMERS) {
+        return -1;
+    }
+ 
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        deleteTimer(i);
+    }
+ 
+    for (int n = 0; n < h.count; n++, a += sizeof(saved_record)) {
+        saved_record r;
+ 
+        EEPROM.get(a, r);
+        if (r.slot >= MAX_TIMERS || r.callback >= registrySize || registry[r.callback] == 0) {
+            continue;
+        }
+ 
+        timer_record &t = timers[r.slot];
+        t.delay = r.delay;
+        t.callback = registry[r.callback];
+        t.maxNumRuns = r.maxNumRuns;
+        t.numRuns = r.numRuns;
+        t.enabled = r.enabled;
+        t.returnsDelay = r.returnsDelay;
+        t.aligned = r.aligned;
+        t.groups = r.groups;
+        t.pausedSince = current_millis;
+        t.toBeCalled = DEFCALL_DONTRUN;
+ 
+        // time left before the reset, minus the time spent down
+        long left = (long)(r.deadline - h.savedAt) - (long)downtime;
+        t.deadline = current_millis + left;
+ 
+        if (left < 0 && t.delay > 0) {
+            long late = -left;
+ 
+            switch (policy) {
+                case CATCHUP_ALL:
+                    // run() catches up by itself, one period per call
+                    break;
+ 
+                case CATCHUP_ONCE:
+                    // due now, and the next deadline back in phase
+                    t.deadline = current_millis - late % t.delay;
+                    break;
+ 
+                case CATCHUP_SKIP:
+                    t.deadline = current_millis + t.delay - late % t.delay;
+                    break;
+            }
+        }
+ 
+        numTimers++;
+    }
+ 
+    if (numTimers > stats.peak) {
+        stats.peak = numTimers;
+    }
+ 
+    return numTimers;
+}
+#endif
+ 
+ 
+void SimpleTimer::getStats(timer_stats &s) {
+    s = stats;
+    s.window = elapsed() - statsStart;
+    s.active = numTimers;
+}
+ 
+ 
+void SimpleTimer::resetStats() {
+    uint8_t peak = stats.peak;
+ 
+    memset(&stats, 0, sizeof(stats));
+    stats.peak = peak;
+    statsStart = elapsed();
+}
+ 
+ 
+// little endian, independent of the struct layout of the host
+static size_t writeStatsField(Print &p, unsigned long v, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p.write((uint8_t)(v >> (8 * i)));
+    }
+ 
+    return bytes;
+}
+ 
+ 
+size_t SimpleTimer::writeStats(Print &p, const timer_stats &s) {
+    size_t n = 0;
+    int i;
+ 
+    // header: format version and bucket count
+    n += writeStatsField(p, 1, 1);
+    n += writeStatsField(p, STATS_BUCKETS, 1);
+ 
+    n += writeStatsField(p, s.window, 4);
+    n += writeStatsField(p, s.fires, 4);
+    n += writeStatsField(p, s.missed, 4);
+    n += writeStatsField(p, s.active, 1);
+    n += writeStatsField(p, s.peak, 1);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        n += writeStatsField(p, s.lateness[i], 2);
+    }
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        n += writeStatsField(p, s.callbackTime[i], 2);
+    }
+ 
+    return n;
+}
+ 
+ 
+// one cumulative histogram, a name_bucket{le="bound"} count line per bucket
+static size_t printStatsHistogram(Print &p, const char *name, const uint16_t *histogram) {
+    size_t n = 0;
+    unsigned long total = 0;
+ 
+    for (int i = 0; i < SimpleTimer::STATS_BUCKETS; i++) {
+        total += histogram[i];
+ 
+        n += p.print(name);
+        n += p.print("_bucket{le=\"");
+        if (i == SimpleTimer::STATS_BUCKETS - 1) {
+            n += p.print("+Inf");
+        } else {
+            n += p.print((1UL << i) - 1);
+        }
+        n += p.print("\"} ");
+        n += p.println(total);
+    }
+ 
+    return n;
+}
+ 
+ 
+size_t SimpleTimer::printStats(Print &p, const timer_stats &s) {
+    size_t n = 0;
+ 
+    n += p.print("simpletimer_active ");
+    n += p.println((unsigned int)s.active);
+    n += p.print("simpletimer_peak ");
+    n += p.println((unsigned int)s.peak);
+    n += p.print("simpletimer_fires_total ");
+    n += p.println((unsigned long)s.fires);
+    n += p.print("simpletimer_fires_per_second ");
+    n += p.println(s.window ? (unsigned long)(s.fires * 1000ULL / s.window) : 0UL);
+    n += p.print("simpletimer_missed_total ");
+    n += p.println((unsigned long)s.missed);
+    n += printStatsHistogram(p, "simpletimer_lateness", s.lateness);
+    n += printStatsHistogram(p, "simpletimer_callback_us", s.callbackTime);
+ 
+    return n;
+}
+ 
+ 
+#if defined(SIMPLETIMER_SIMULATE)
+// returns the simulated time
+unsigned long simMillis() {
+    return sim_millis;
+}
+ 
+ 
+// sets the simulated time, e.g. just before the millis() wrap
+void simSetMillis(unsigned long ms) {
+    sim_millis = ms;
+}
+ 
+ 
+// runs the n given timers for ms of simulated time, jumping from one
+// deadline to the next instead of ticking through every millisecond
+void simAdvance(SimpleTimer *timers[], int n, unsigned long ms) {
+    unsigned long left = ms;
+ 
+    for (;;) {
+        long next = -1;
+        int i;
+ 
+        for (i = 0; i < n; i++) {
+            timers[i]->run();
+        }
+ 
+        for (i = 0; i < n; i++) {
+            long t = timers[i]->getTimeToNextTimer();
+ 
+            if (t >= 0 && (next < 0 || t < next)) {
+                next = t;
+            }
+        }
+ 
+        // zero delay timers are due on every run(), step over them
+        if (next == 0) {
+            next = 1;
+        }
+ 
+        if (next < 0 || (unsigned long)next > left) {
+            sim_millis += left;
+            break;
+        }
+ 
+        sim_millis += next;
+        left -= next;
+    }
+}
+#endif
 
 ////////////////////////////////////////////////////
 
+// uncomment to replace the demo below with the arm/cancel/expire churn benchmark
+//#define SIMPLETIMER_BENCHMARK
+
+#if defined(SIMPLETIMER_BENCHMARK)
+
+// workload, all deterministic for a given seed
+const unsigned long BENCH_SEED = 12345;
+const unsigned long BENCH_ARM_RATE = 20;        // timers armed per second
+const int BENCH_CANCEL_PERCENT = 80;            // armed timers cancelled before they expire
+const int BENCH_PERIODIC_PERCENT = 10;          // armed timers that are periodic
+const long BENCH_DELAY_MIN = 5;                 // delays are uniform in [min, max] ms
+const long BENCH_DELAY_MAX = 500;
+const unsigned long BENCH_REPORT_MS = 10000;
+
+// lateness histogram, 1 ms buckets, the last one catches everything above
+const int BENCH_LATENESS_BUCKETS = 32;
+
+SimpleTimer bench;
+unsigned long bench_lateness[BENCH_LATENESS_BUCKETS];
+unsigned long bench_cancelAt[SimpleTimer::MAX_TIMERS];     // 0 == no cancel pending
+unsigned long bench_arms, bench_armFails, bench_cancels, bench_fires, bench_loops;
+unsigned long bench_start, bench_nextArm, bench_nextReport;
+
+void bench_fire() {
+    bench_fires++;
+}
+
+void bench_hook(int, unsigned long due) {
+    unsigned long late = millis() - due;
+
+    if (late >= (unsigned long)BENCH_LATENESS_BUCKETS) {
+        late = BENCH_LATENESS_BUCKETS - 1;
+    }
+    bench_lateness[late]++;
+}
+
+// lateness in ms below which pct percent of the fires were
+int bench_percentile(int pct) {
+    unsigned long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LATENESS_BUCKETS; i++) {
+        total += bench_lateness[i];
+    }
+    for (i = 0; i < BENCH_LATENESS_BUCKETS; i++) {
+        seen += bench_lateness[i];
+        if (seen * 100 >= total * pct) {
+            break;
+        }
+    }
+    return i;
+}
+
+#if defined(__AVR__)
+extern char *__brkval;
+extern char __heap_start;
+
+int bench_freeRam() {
+    char top;
+    return &top - (__brkval ? __brkval : &__heap_start);
+}
+#else
+int bench_freeRam() {
+    return -1;
+}
+#endif
+
+void setup() {
+    Serial.begin(9600);
+    randomSeed(BENCH_SEED);
+    bench.setFireHook(bench_hook);
+
+    bench_start = millis();
+    bench_nextArm = bench_start;
+    bench_nextReport = bench_start + BENCH_REPORT_MS;
+}
+
+void loop() {
+    unsigned long now;
+
+    bench.run();
+    bench_loops++;
+
+    now = millis();
+
+    // arm at the configured rate
+    while ((long)(now - bench_nextArm) >= 0) {
+        long d = random(BENCH_DELAY_MIN, BENCH_DELAY_MAX + 1);
+        int id;
+
+        bench_nextArm += 1000 / BENCH_ARM_RATE;
+
+        boolean periodic = random(100) < BENCH_PERIODIC_PERCENT;
+
+        if (periodic) {
+            id = bench.setInterval(d, bench_fire);
+        } else {
+            id = bench.setTimeout(d, bench_fire);
+        }
+
+        if (id < 0) {
+            bench_armFails++;
+            continue;
+        }
+        bench_arms++;
+
+        // periodic timers live for a few periods, most timeouts get
+        // cancelled somewhere before they expire
+        bench_cancelAt[id] = 0;
+        if (periodic) {
+            bench_cancelAt[id] = now + d * random(1, 10) + 1;
+        } else if (random(100) < BENCH_CANCEL_PERCENT) {
+            bench_cancelAt[id] = now + random(d) + 1;
+        }
+    }
+
+    for (int i = 0; i < SimpleTimer::MAX_TIMERS; i++) {
+        if (bench_cancelAt[i] && (long)(now - bench_cancelAt[i]) >= 0) {
+            bench_cancelAt[i] = 0;
+
+            // still there, i.e. not expired yet
+            if (bench.isEnabled(i)) {
+                bench.deleteTimer(i);
+                bench_cancels++;
+            }
+        }
+    }
+
+    if ((long)(now - bench_nextReport) >= 0) {
+        unsigned long secs = (now - bench_start) / 1000;
+        unsigned long ops = bench_arms + bench_cancels + bench_fires;
+
+        bench_nextReport += BENCH_REPORT_MS;
+
+        Serial.print("t=");
+        Serial.print(secs);
+        Serial.print("s ops/s=");
+        Serial.print(ops / secs);
+        Serial.print(" arms=");
+        Serial.print(bench_arms);
+        Serial.print(" full=");
+        Serial.print(bench_armFails);
+        Serial.print(" cancels=");
+        Serial.print(bench_cancels);
+        Serial.print(" fires=");
+        Serial.print(bench_fires);
+        Serial.print(" run/s=");
+        Serial.print(bench_loops / secs);
+        Serial.print(" late p50/p90/p99=");
+        Serial.print(bench_percentile(50));
+        Serial.print("/");
+        Serial.print(bench_percentile(90));
+        Serial.print("/");
+        Serial.print(bench_percentile(99));
+        Serial.print("ms timers=");
+        Serial.print(bench.getNumTimers());
+        Serial.print(" sizeof=");
+        Serial.print((int)sizeof(SimpleTimer));
+        Serial.print(" free=");
+        Serial.println(bench_freeRam());
+    }
+}
+
+#else
+
 int led_red = 7;		// Red LED: Pin 0
 int led_yellow = 6; 	// Yellow LED: Pin 1
 int led_green = 5; 		// Green LED: Pin 2
@@ -338,3 +1371,5 @@ void toggle_green() {
     state_green = !state_green;
     digitalWrite(led_green, state_green);
 }
+
+#endif
@@ -328,6 +328,15 @@ class TimerOne
 #if defined (__AVR_ATmega8__)
   //in some io definitions for older microcontrollers TIMSK is used instead of TIMSK1
   #define TIMSK1 TIMSK
+  #define TIFR1 TIFR
+  #define ICIE1 TICIE1
+#endif
+// the TIMSK1 bits Timer1 owns; on the ATmega8 the rest belong to Timer0 and
+// Timer2, so only ever clear these
+#if defined(OCIE1C)
+  #define TIMER1_INTERRUPTS (_BV(TOIE1) | _BV(OCIE1A) | _BV(OCIE1B) | _BV(OCIE1C) | _BV(ICIE1))
+#else
+  #define TIMER1_INTERRUPTS (_BV(TOIE1) | _BV(OCIE1A) | _BV(OCIE1B) | _BV(ICIE1))
 #endif
 	
   public:
@@ -337,6 +346,7 @@ class TimerOne
     void initialize(unsigned long microseconds=1000000) __attribute__((always_inline)) {
 	TCCR1B = _BV(WGM13);        // set mode as phase and frequency correct pwm, stop the timer
 	TCCR1A = 0;                 // clear control register A 
+	TIMSK1 &= ~TIMER1_INTERRUPTS | _BV(TOIE1); // drop the compare and capture interrupts of other modes
 	setPeriod(microseconds);
     }
     void setPeriod(unsigned long microseconds) __attribute__((always_inline)) {
@@ -364,8 +374,25 @@ class TimerOne
 		clockSelectBits = _BV(CS12) | _BV(CS10);
 		pwmPeriod = TIMER1_RESOLUTION - 1;
 	}
+	if ((TCCR1B & (_BV(WGM13) | _BV(WGM12) | _BV(CS12) | _BV(CS11) | _BV(CS10))) == (_BV(WGM13) | clockSelectBits)) {
+		// running with the same prescaler: move the duties and TOP at
+		// the next cycle boundaries from the overflow interrupt
+		uint8_t oldSREG = SREG;
+		cli();
+		periodPhase = 1;
+		TIMSK1 |= _BV(TOIE1);
+		SREG = oldSREG;
+		return;
+	}
 	ICR1 = pwmPeriod;
 	TCCR1B = _BV(WGM13) | clockSelectBits;
+	rescalePwmDuty();
+    }
+    void setPeriodCounts(unsigned short counts) __attribute__((always_inline)) {
+	// TOP isn't buffered, but from the overflow interrupt (BOTTOM) the
+	// counter is still far below it, so the cycle just started gets it
+	pwmPeriod = counts;
+	ICR1 = counts;
     }
 
     //****************************
@@ -393,12 +420,22 @@ class TimerOne
 	unsigned long dutyCycle = pwmPeriod;
 	dutyCycle *= duty;
 	dutyCycle >>= 10;
-	if (pin == TIMER1_A_PIN) OCR1A = dutyCycle;
+	if (pin == TIMER1_A_PIN) { OCR1A = dutyCycle; pwmDuty[0] = duty; }
+	#ifdef TIMER1_B_PIN
+	else if (pin == TIMER1_B_PIN) { OCR1B = dutyCycle; pwmDuty[1] = duty; }
+	#endif
+	#ifdef TIMER1_C_PIN
+	else if (pin == TIMER1_C_PIN) { OCR1C = dutyCycle; pwmDuty[2] = duty; }
+	#endif
+    }
+    // reapply the duties of the connected outputs to the current period
+    void rescalePwmDuty() __attribute__((always_inline)) {
+	if (TCCR1A & _BV(COM1A1)) setPwmDuty(TIMER1_A_PIN, pwmDuty[0]);
 	#ifdef TIMER1_B_PIN
-	else if (pin == TIMER1_B_PIN) OCR1B = dutyCycle;
+	if (TCCR1A & _BV(COM1B1)) setPwmDuty(TIMER1_B_PIN, pwmDuty[1]);
 	#endif
 	#ifdef TIMER1_C_PIN
-	else if (pin == TIMER1_C_PIN) OCR1C = dutyCycle;
+	if (TCCR1A & _BV(COM1C1)) setPwmDuty(TIMER1_C_PIN, pwmDuty[2]);
 	#endif
     }
     void pwm(char pin, unsigned int duty) __attribute__((always_inline)) {
@@ -426,23 +463,126 @@ class TimerOne
 	#endif
     }
 
+    //****************************
+    //  One Pulse
+    //****************************
+    // Emit a single pulse on a TIMER1 pin in hardware, without blocking:
+    // fast PWM with TOP = 0xFFFF and an inverting output sets the pin at
+    // the compare match and clears it at the wrap to BOTTOM, where the
+    // overflow interrupt stops the clock, disconnects the pin and calls
+    // done. The width is capped so the counter stays at least 128 counts
+    // short of the compare value again by the time the interrupt runs. The
+    // cycle version runs at clk/1 (width at most 65408 cycles, width + delay
+    // at most 65536, delay at least 1), the microsecond one picks a
+    // prescaler. Takes Timer1 over until the next initialize(); a callback
+    // given to attachInterrupt() is put back when the pulse ends.
+    void pulseCycles(char pin, unsigned int widthCycles, unsigned int delayCycles = 1, void (*done)() = 0) {
+	pulseCounts(pin, widthCycles, delayCycles, _BV(CS10), done);
+    }
+    void pulse(char pin, unsigned long widthMicroseconds, unsigned long delayMicroseconds = 0, void (*done)() = 0);
+    bool pulsing() { return pulseBusy; }
+
+  private:
+    void pulseCounts(char pin, unsigned long width, unsigned long delay, unsigned char clock, void (*done)());
+    static void pulseIsr();
+    static void (*pulseDone)();
+    static void (*pulseUserCallback)();
+    static unsigned char pulseUserTimsk;	// TOIE1 as attachInterrupt() left it
+    static unsigned char pulseCom;		// COM1x bits of the pulse pin
+    static volatile bool pulseBusy;
+
+  public:
+#if defined(TIMERONE_PWM_INPUT) && defined(TIMER1_ICP_PIN)
+    //****************************
+    //  PWM Input
+    //****************************
+    // Measure a PWM signal on TIMER1_ICP_PIN in the background: Timer1
+    // free-runs at clk/8 with its overflows counted in software, and the
+    // capture interrupt timestamps every edge, toggling the capture edge
+    // each time. readPwmInput() returns the latest period and high time in
+    // microseconds, read atomically, and true if they are new since the
+    // last call. Takes Timer1 over until the next initialize(). Only built
+    // with TIMERONE_PWM_INPUT defined, as it defines TIMER1_CAPT_vect.
+    void pwmInput();
+    bool readPwmInput(unsigned long &periodMicroseconds, unsigned long &highMicroseconds);
+    void captureIsr();
+
+  private:
+    static void captureOverflow();
+    static volatile unsigned short captureOverflows;	// upper 16 bits of the timestamps
+    static unsigned long captureRise;
+    static bool captureStarted;			// captureRise is valid
+    static volatile unsigned long capturePeriod;	// in timer counts
+    static volatile unsigned long captureHigh;
+    static volatile bool captureFresh;
+
+  public:
+#endif
+#if defined(TIMERONE_COMPARE)
+    //****************************
+    //  Compare Channels
+    //****************************
+    // Run Timer1 free (normal mode, 65536 counts per wrap) at clk/prescale
+    // (1, 8, 64, 256 or 1024) so each compare channel can raise its own
+    // interrupt. A periodic channel advances OCR1x by its period before
+    // calling the handler, so every channel keeps an exact rate of its own.
+    // With microseconds 0 the handler runs each time the counter passes
+    // the value given to setCompare(), which leaves re-arming to it. The
+    // overflow interrupt stays available through attachInterrupt(). Only
+    // built with TIMERONE_COMPARE defined, as it defines the TIMER1_COMPx
+    // vectors, which Servo and sketches with their own handlers also use.
+    enum { COMPARE_A, COMPARE_B, COMPARE_C };
+    void freeRun(unsigned int prescale = 8);
+    void attachCompareInterrupt(unsigned char channel, void (*isr)(), unsigned long microseconds);
+    void detachCompareInterrupt(unsigned char channel);
+    void setCompare(unsigned char channel, unsigned short counts);
+    unsigned short readCounter() {
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned short counts = TCNT1;
+	SREG = oldSREG;
+	return counts;
+    }
+    // timer counts per microsecond in free-running mode, 16.16 fixed point
+    unsigned long countsPerMicrosecond() { return ((F_CPU / 1000000) << 16) >> freeRunShift; }
+
+    static void compareIsr(unsigned char channel) __attribute__((always_inline)) {
+	unsigned short period = comparePeriod[channel];
+	if (channel == COMPARE_A) OCR1A += period;
+	else if (channel == COMPARE_B) OCR1B += period;
+	#ifdef OCIE1C
+	else OCR1C += period;
+	#endif
+	compareCallback[channel]();
+    }
+
+  private:
+    static unsigned char freeRunShift;		// log2 of the prescaler
+    static void (*compareCallback[3])();
+    static unsigned short comparePeriod[3];	// in timer counts, 0 for handler managed
+
+  public:
+#endif
     //****************************
     //  Interrupt Function
     //****************************
 	
     void attachInterrupt(void (*isr)()) __attribute__((always_inline)) {
 	isrCallback = isr;
-	TIMSK1 = _BV(TOIE1);
+	TIMSK1 |= _BV(TOIE1);
     }
     void attachInterrupt(void (*isr)(), unsigned long microseconds) __attribute__((always_inline)) {
 	if(microseconds > 0) setPeriod(microseconds);
 	attachInterrupt(isr);
     }
     void detachInterrupt() __attribute__((always_inline)) {
-	TIMSK1 = 0;
+	isrCallback = isrDefaultUnused;
+	if (!periodPhase) TIMSK1 &= ~_BV(TOIE1);	// a buffered setPeriod() still needs it
     }
     static void (*isrCallback)();
     static void isrDefaultUnused();
+    static void periodUpdate();
+    static volatile unsigned char periodPhase;	// buffered setPeriod() steps left
 
   private:
     // properties
@@ -563,9 +703,37 @@ class TimerOne
 	}
 
 	uint32_t sc = FTM1_SC;
+	if ((sc & (FTM_SC_CLKS(3) | FTM_SC_CPWMS | FTM_SC_PS(7))) == (FTM_SC_CLKS(1) | FTM_SC_CPWMS | clockSelectBits)) {
+		// running with the same prescaler: MOD and CnV are buffered
+		// and load together when the counter next turns at MOD
+		FTM1_MOD = pwmPeriod;
+		writePwmDuty(TIMER1_A_PIN, pwmDuty[0]);
+		writePwmDuty(TIMER1_B_PIN, pwmDuty[1]);
+		syncPwm();
+		return;
+	}
 	FTM1_SC = 0;
+	#if defined(KINETISK)
+	// buffer MOD and C0V/C1V until a software sync, which loads them all
+	// at the next turn at MOD, so a reload never lands between two writes
+	FTM1_MODE = FTM_MODE_WPDIS | FTM_MODE_FTMEN;
+	FTM1_COMBINE = FTM_COMBINE_SYNCEN0;
+	FTM1_SYNC = FTM_SYNC_CNTMAX;
+	#endif
 	FTM1_MOD = pwmPeriod;
 	FTM1_SC = FTM_SC_CLKS(1) | FTM_SC_CPWMS | clockSelectBits | (sc & FTM_SC_TOIE);
+	writePwmDuty(TIMER1_A_PIN, pwmDuty[0]);
+	writePwmDuty(TIMER1_B_PIN, pwmDuty[1]);
+	syncPwm();
+    }
+    void setPeriodCounts(unsigned short counts) __attribute__((always_inline)) {
+	// with the clock running MOD is buffered until the end of the cycle,
+	// and loads there with the duties rescaled to it
+	pwmPeriod = counts;
+	FTM1_MOD = counts;
+	writePwmDuty(TIMER1_A_PIN, pwmDuty[0]);
+	writePwmDuty(TIMER1_B_PIN, pwmDuty[1]);
+	syncPwm();
     }
 
     //****************************
@@ -590,15 +758,27 @@ class TimerOne
     //  PWM outputs
     //****************************
     void setPwmDuty(char pin, unsigned int duty) __attribute__((always_inline)) {
+	writePwmDuty(pin, duty);
+	syncPwm();
+    }
+    // CnV only; the new value loads at the next syncPwm()
+    void writePwmDuty(char pin, unsigned int duty) __attribute__((always_inline)) {
 	unsigned long dutyCycle = pwmPeriod;
 	dutyCycle *= duty;
 	dutyCycle >>= 10;
 	if (pin == TIMER1_A_PIN) {
 		FTM1_C0V = dutyCycle;
+		pwmDuty[0] = duty;
 	} else if (pin == TIMER1_B_PIN) {
 		FTM1_C1V = dutyCycle;
+		pwmDuty[1] = duty;
 	}
     }
+    void syncPwm() __attribute__((always_inline)) {
+	#if defined(KINETISK)
+	FTM1_SYNC = FTM_SYNC_CNTMAX | FTM_SYNC_SWSYNC;
+	#endif
+    }
     void pwm(char pin, unsigned int duty) __attribute__((always_inline)) {
 	setPwmDuty(pin, duty);
 	if (pin == TIMER1_A_PIN) {
@@ -619,6 +799,66 @@ class TimerOne
 	}
     }
 
+#if defined(KINETISK)
+    //****************************
+    //  Quadrature Decoder
+    //****************************
+    // Count an encoder on pins 3 (phase A) and 4 (phase B) with the FTM1
+    // quadrature decoder: the counter follows the edges in hardware and the
+    // overflow interrupt extends it to 32 bits, using TOFDIR for the
+    // direction of the wrap. filter (0-15) enables the input glitch filter,
+    // rejecting pulses shorter than 4 * filter bus clocks. Takes FTM1 over
+    // until endQuadrature() and the next initialize().
+    void quadrature(unsigned char filter = 0) __attribute__((always_inline)) {
+	FTM1_SC = 0;
+	FTM1_MODE = FTM_MODE_WPDIS | FTM_MODE_FTMEN;
+	FTM1_C0SC = 0;
+	FTM1_C1SC = 0;
+	FTM1_CNTIN = 0;
+	FTM1_MOD = 0xFFFF;
+	FTM1_CNT = 0;
+	FTM1_FILTER = FTM_FILTER_CH0FVAL(filter) | FTM_FILTER_CH1FVAL(filter);
+	FTM1_QDCTRL = FTM_QDCTRL_QUADEN | (filter ? FTM_QDCTRL_PHAFLTREN | FTM_QDCTRL_PHBFLTREN : 0);
+	quadHigh = 0;
+	quadLast = 0;
+	quadVelocity = 0;
+	*portConfigRegister(TIMER1_A_PIN) = PORT_PCR_MUX(7) | PORT_PCR_PE | PORT_PCR_PS;
+	*portConfigRegister(TIMER1_B_PIN) = PORT_PCR_MUX(7) | PORT_PCR_PE | PORT_PCR_PS;
+	isrCallback = quadIsr;
+	FTM1_SC = FTM_SC_CLKS(1) | FTM_SC_TOIE;
+	NVIC_ENABLE_IRQ(IRQ_FTM1);
+    }
+    void endQuadrature() __attribute__((always_inline)) {
+	detachInterrupt();
+	FTM1_SC = 0;
+	FTM1_QDCTRL = 0;
+	FTM1_MODE = FTM_MODE_WPDIS;
+	FTM1_C0SC = FTM_CSC_MSB | FTM_CSC_ELSB;		// PWM channels again
+	FTM1_C1SC = FTM_CSC_MSB | FTM_CSC_ELSB;
+	*portConfigRegister(TIMER1_A_PIN) = 0;
+	*portConfigRegister(TIMER1_B_PIN) = 0;
+	isrCallback = isrDefaultUnused;
+    }
+    // 32 bit position; safe with interrupts enabled or disabled
+    long readPosition();
+    void writePosition(long position);
+    // call at a fixed rate (IntervalTimer, MsTimer2): velocity() is then
+    // the position change over the last interval, in counts
+    void updateVelocity() {
+	long position = readPosition();
+	quadVelocity = position - quadLast;
+	quadLast = position;
+    }
+    long velocity() { return quadVelocity; }
+
+  private:
+    static void quadIsr();
+    static volatile long quadHigh;	// position minus the 16 bit counter
+    static long quadLast;
+    static volatile long quadVelocity;
+
+  public:
+#endif
     //****************************
     //  Interrupt Function
     //****************************
@@ -666,6 +906,18 @@ class TimerOne
 		}
 	}
 	//Serial.printf("setPeriod, period=%u, prescale=%u\n", period, prescale);
+	if ((FLEXPWM1_MCTRL & FLEXPWM_MCTRL_RUN(8)) && prescale == clockSelectBits) {
+		// running with the same prescaler: INIT, VAL1 and the duties
+		// are buffered and load together at the next reload (LDOK)
+		pwmPeriod = period;
+		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+		FLEXPWM1_SM3INIT = -period;
+		FLEXPWM1_SM3VAL1 = period;
+		writePwmDuty(TIMER1_A_PIN, pwmDuty[0]);
+		writePwmDuty(TIMER1_B_PIN, pwmDuty[1]);
+		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
+		return;
+	}
 	FLEXPWM1_FCTRL0 |= FLEXPWM_FCTRL0_FLVL(8); // logic high = fault
 	FLEXPWM1_FSTS0 = 0x0008; // clear fault status
 	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
@@ -680,6 +932,18 @@ class TimerOne
 	FLEXPWM1_SM3VAL5 = 0;
 	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8) | FLEXPWM_MCTRL_RUN(8);
 	pwmPeriod = period;
+	clockSelectBits = prescale;
+    }
+    void setPeriodCounts(unsigned short counts) __attribute__((always_inline)) {
+	// buffered, loaded at the next reload once LDOK is set, together
+	// with the duties rescaled to it
+	pwmPeriod = counts;
+	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+	FLEXPWM1_SM3INIT = -counts;
+	FLEXPWM1_SM3VAL1 = counts;
+	writePwmDuty(TIMER1_A_PIN, pwmDuty[0]);
+	writePwmDuty(TIMER1_B_PIN, pwmDuty[1]);
+	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
     }
     //****************************
     //  Run Control
@@ -703,19 +967,23 @@ class TimerOne
     //  PWM outputs
     //****************************
     void setPwmDuty(char pin, unsigned int duty) __attribute__((always_inline)) {
+	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+	writePwmDuty(pin, duty);
+	FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
+    }
+    // VAL2-5 only, between a CLDOK and the LDOK that loads them
+    void writePwmDuty(char pin, unsigned int duty) __attribute__((always_inline)) {
 	if (duty > 1023) duty = 1023;
 	int dutyCycle = (pwmPeriod * duty) >> 10;
 	//Serial.printf("setPwmDuty, period=%u\n", dutyCycle);
 	if (pin == TIMER1_A_PIN) {
-		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+		pwmDuty[0] = duty;
 		FLEXPWM1_SM3VAL5 = dutyCycle;
 		FLEXPWM1_SM3VAL4 = -dutyCycle;
-		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
 	} else if (pin == TIMER1_B_PIN) {
-		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+		pwmDuty[1] = duty;
 		FLEXPWM1_SM3VAL3 = dutyCycle;
 		FLEXPWM1_SM3VAL2 = -dutyCycle;
-		FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
 	}
     }
     void pwm(char pin, unsigned int duty) __attribute__((always_inline)) {
@@ -769,6 +1037,44 @@ class TimerOne
     static unsigned char clockSelectBits;
 
 #endif
+
+#if !defined (__AVR_ATtiny85__)
+  public:
+    // the current period in timer counts, i.e. the 100% duty compare value
+    unsigned short getPeriodCounts() { return pwmPeriod; }
+
+  private:
+    // the 10 bit duty last set on each output, reapplied by setPeriod()
+    static unsigned int pwmDuty[3];
+
+  public:
+
+    //****************************
+    //  Frequency Sweep
+    //****************************
+    // Sweep the PWM on pin from startMicroseconds to endMicroseconds over
+    // cycles periods, then hold the end period. The period is changed from
+    // the overflow interrupt, i.e. at each cycle boundary, and the counter
+    // is never stopped, so the output stays phase continuous. Linear sweeps
+    // change the period by the same step each cycle, logarithmic ones by
+    // the same ratio. A callback given to attachInterrupt() keeps running.
+    void sweep(char pin, unsigned int duty, unsigned long startMicroseconds, unsigned long endMicroseconds,
+               unsigned long cycles, bool logarithmic = false);
+    void stopSweep();
+    bool sweeping() { return sweepCycles != 0; }
+
+  private:
+    static void sweepIsr();
+    static void (*sweepUserCallback)();
+    static volatile unsigned long sweepCycles;	// cycles left
+    static unsigned long sweepPeriod;		// period in counts, 16.16 fixed point (linear)
+    static unsigned long sweepStep;		// signed step, modulo 2^32
+    static float sweepPeriodF;			// period in counts (logarithmic)
+    static float sweepRatio;
+    static bool sweepLog;
+    static char sweepPin;
+    static unsigned int sweepDuty;
+#endif
 };
 
 //extern TimerOne Timer1;
@@ -790,6 +1096,7 @@ ISR(TIMER1_COMPA_vect)
 #elif defined(__AVR__)
 ISR(TIMER1_OVF_vect)
 {
+  if (Timer1.periodPhase) Timer1.periodUpdate();
   Timer1.isrCallback();
 }
 #elif defined(__arm__) && defined(TEENSYDUINO) && (defined(KINETISK) || defined(KINETISL))
@@ -815,6 +1122,887 @@ void TimerOne::isrDefaultUnused()
 {
 }
 
+#if !defined (__AVR_ATtiny85__)
+unsigned int TimerOne::pwmDuty[3] = { 0, 0, 0 };
+#endif
+
+#if defined(__AVR__) && !defined (__AVR_ATtiny85__)
+volatile unsigned char TimerOne::periodPhase = 0;
+
+// buffered setPeriod(): the OCR1x are double buffered and load at BOTTOM,
+// ICR1 is not, so write the duties one cycle ahead and TOP at the BOTTOM
+// where they load, while the counter is still far below it
+void TimerOne::periodUpdate()
+{
+  if (periodPhase == 1) {
+    Timer1.rescalePwmDuty();
+    periodPhase = 2;
+  } else {
+    ICR1 = pwmPeriod;
+    periodPhase = 0;
+    if (isrCallback == isrDefaultUnused) TIMSK1 &= ~_BV(TOIE1);
+  }
+}
+#endif
+
+#if !defined (__AVR_ATtiny85__)
+void (*TimerOne::sweepUserCallback)() = TimerOne::isrDefaultUnused;
+volatile unsigned long TimerOne::sweepCycles = 0;
+unsigned long TimerOne::sweepPeriod = 0;
+unsigned long TimerOne::sweepStep = 0;
+float TimerOne::sweepPeriodF = 0;
+float TimerOne::sweepRatio = 1;
+bool TimerOne::sweepLog = false;
+char TimerOne::sweepPin = 0;
+unsigned int TimerOne::sweepDuty = 0;
+
+void TimerOne::sweep(char pin, unsigned int duty, unsigned long startMicroseconds, unsigned long endMicroseconds,
+                     unsigned long cycles, bool logarithmic)
+{
+  stopSweep();
+
+  // one prescaler for the whole sweep, the one the longest period needs
+  unsigned long longest = startMicroseconds > endMicroseconds ? startMicroseconds : endMicroseconds;
+  setPeriod(longest);
+  unsigned long startCounts = (unsigned long long)pwmPeriod * startMicroseconds / longest;
+  unsigned long endCounts = (unsigned long long)pwmPeriod * endMicroseconds / longest;
+  if (startCounts < 2) startCounts = 2;
+  if (endCounts < 2) endCounts = 2;
+  if (cycles == 0) cycles = 1;
+
+  sweepPin = pin;
+  sweepDuty = duty;
+  sweepLog = logarithmic;
+  // a step of up to +-65535 counts doesn't fit a long in 16.16, but the
+  // period always stays in range, so adding it modulo 2^32 comes out right
+  sweepStep = ((long long)endCounts - (long long)startCounts) * 65536 / (long long)cycles;
+  sweepRatio = pow((float)endCounts / (float)startCounts, 1.0f / (float)cycles);
+  // one step back, so the first interrupt lands on the start period
+  sweepPeriod = (startCounts << 16) - sweepStep;
+  sweepPeriodF = startCounts / sweepRatio;
+
+  // TOP isn't buffered, and the counter may already be past startCounts:
+  // run the longest period until the interrupt applies the start at BOTTOM
+  pwm(pin, duty);
+
+  sweepUserCallback = isrCallback;
+  sweepCycles = cycles + 1;
+  attachInterrupt(sweepIsr);
+}
+
+void TimerOne::stopSweep()
+{
+  sweepCycles = 0;
+  if (isrCallback == sweepIsr) {
+    isrCallback = sweepUserCallback;
+    if (isrCallback == isrDefaultUnused) detachInterrupt();
+  }
+}
+
+void TimerOne::sweepIsr()
+{
+  if (sweepCycles) {
+    unsigned long counts;
+    if (sweepLog) {
+      sweepPeriodF *= sweepRatio;
+      counts = sweepPeriodF + 0.5f;
+    } else {
+      sweepPeriod += sweepStep;
+      counts = sweepPeriod >> 16;
+    }
+    Timer1.setPeriodCounts(counts);
+    Timer1.setPwmDuty(sweepPin, sweepDuty);
+    sweepCycles--;
+  }
+  sweepUserCallback();
+}
+#endif
+
+#if defined(__arm__) && defined(TEENSYDUINO) && defined(KINETISK)
+volatile long TimerOne::quadHigh = 0;
+long TimerOne::quadLast = 0;
+volatile long TimerOne::quadVelocity = 0;
+
+long TimerOne::readPosition()
+{
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n" : "=r" (primask)::);
+  __disable_irq();
+  long high = quadHigh;
+  uint16_t count = FTM1_CNT;
+  if (FTM1_SC & FTM_SC_TOF) {
+    // wrapped, but the interrupt hasn't run yet: account for it here
+    count = FTM1_CNT;
+    high += (FTM1_QDCTRL & FTM_QDCTRL_TOFDIR) ? 0x10000L : -0x10000L;
+  }
+  if (!primask) __enable_irq();
+  return high + count;
+}
+
+void TimerOne::writePosition(long position)
+{
+  // the counter keeps running, only the extension moves
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n" : "=r" (primask)::);
+  __disable_irq();
+  quadHigh += position - readPosition();
+  quadLast = position;
+  if (!primask) __enable_irq();
+}
+
+void TimerOne::quadIsr()
+{
+  quadHigh += (FTM1_QDCTRL & FTM_QDCTRL_TOFDIR) ? 0x10000L : -0x10000L;
+}
+#endif
+
+#if defined(__AVR__) && !defined (__AVR_ATtiny85__)
+void (*TimerOne::pulseDone)() = TimerOne::isrDefaultUnused;
+void (*TimerOne::pulseUserCallback)() = TimerOne::isrDefaultUnused;
+unsigned char TimerOne::pulseUserTimsk = 0;
+unsigned char TimerOne::pulseCom = 0;
+volatile bool TimerOne::pulseBusy = false;
+
+// longest pulse in counts: after the wrap that ends it the counter must
+// not get back to the compare value before the overflow interrupt has
+// stopped it, which takes well under 128 CPU cycles
+#define PULSE_MAX_WIDTH (0x10000UL - 128)
+
+void TimerOne::pulse(char pin, unsigned long widthMicroseconds, unsigned long delayMicroseconds, void (*done)())
+{
+  unsigned long width = (F_CPU / 100000 * widthMicroseconds) / 10;
+  unsigned long delay = (F_CPU / 100000 * delayMicroseconds) / 10;
+  unsigned long total = width + delay;
+  if (total <= PULSE_MAX_WIDTH) pulseCounts(pin, width, delay, _BV(CS10), done);
+  else if (total <= PULSE_MAX_WIDTH * 8) pulseCounts(pin, width / 8, delay / 8, _BV(CS11), done);
+  else if (total <= PULSE_MAX_WIDTH * 64) pulseCounts(pin, width / 64, delay / 64, _BV(CS11) | _BV(CS10), done);
+  else if (total <= PULSE_MAX_WIDTH * 256) pulseCounts(pin, width / 256, delay / 256, _BV(CS12), done);
+  else pulseCounts(pin, width / 1024, delay / 1024, _BV(CS12) | _BV(CS10), done);
+}
+
+void TimerOne::pulseCounts(char pin, unsigned long width, unsigned long delay, unsigned char clock, void (*done)())
+{
+  if (width < 1) width = 1;
+  if (width > PULSE_MAX_WIDTH) width = PULSE_MAX_WIDTH;
+  if (delay < 1) delay = 1;	// a TCNT1 write blocks the compare match on the next clock
+  if (width + delay > 0x10000UL) delay = 0x10000UL - width;
+  unsigned short ocr = 0x10000UL - width;	// high from OCR1x through TOP
+  unsigned char com, foc;
+  if (pin == TIMER1_A_PIN) { com = _BV(COM1A1); foc = _BV(FOC1A); }
+  #ifdef TIMER1_B_PIN
+  else if (pin == TIMER1_B_PIN) { com = _BV(COM1B1); foc = _BV(FOC1B); }
+  #endif
+  #ifdef TIMER1_C_PIN
+  else if (pin == TIMER1_C_PIN) { com = _BV(COM1C1); foc = _BV(FOC1C); }
+  #endif
+  else return;		// not a Timer1 pin: leave the timer as it is
+
+  // normal mode, stopped: OCR1x is written through, and clear-on-match
+  // plus a forced compare drives the pin low before it becomes an output
+  if (!pulseBusy && isrCallback != pulseIsr) {
+    pulseUserCallback = isrCallback;
+    pulseUserTimsk = TIMSK1 & _BV(TOIE1);
+  }
+  TIMSK1 &= ~TIMER1_INTERRUPTS;
+  TCCR1B = 0;
+  if (com == _BV(COM1A1)) OCR1A = ocr;
+  #ifdef TIMER1_B_PIN
+  else if (com == _BV(COM1B1)) OCR1B = ocr;
+  #endif
+  #ifdef TIMER1_C_PIN
+  else OCR1C = ocr;
+  #endif
+  TCCR1A = com;
+  #if defined(TCCR1C)
+  TCCR1C = foc;
+  #else
+  TCCR1A = com | foc;
+  #endif
+  digitalWrite(pin, LOW);	// what the pin shows once disconnected again
+  pinMode(pin, OUTPUT);
+  pulseCom = com | (com >> 1);
+
+  // fast PWM, TOP = ICR1, inverting (set at match, clear at BOTTOM)
+  ICR1 = 0xFFFF;
+  TCCR1A = pulseCom | _BV(WGM11);
+  TCCR1B = _BV(WGM13) | _BV(WGM12);
+  TCNT1 = ocr - delay;
+  clockSelectBits = clock;
+  pwmPeriod = 0xFFFF;
+  pulseDone = done ? done : isrDefaultUnused;
+  pulseBusy = true;
+  isrCallback = pulseIsr;
+  TIFR1 = _BV(TOV1);
+  TIMSK1 |= _BV(TOIE1);
+  TCCR1B = _BV(WGM13) | _BV(WGM12) | clock;
+}
+
+// TOP reached: the pulse ends at this wrap, stop before the next match and
+// disconnect the pin, so it stays low even if the counter got that far
+void TimerOne::pulseIsr()
+{
+  TCCR1B = _BV(WGM13) | _BV(WGM12);
+  TCCR1A &= ~pulseCom;
+  isrCallback = pulseUserCallback;
+  TIMSK1 = (TIMSK1 & ~_BV(TOIE1)) | pulseUserTimsk;
+  pulseBusy = false;
+  pulseDone();
+}
+
+#if defined(TIMERONE_PWM_INPUT) && defined(TIMER1_ICP_PIN)
+volatile unsigned short TimerOne::captureOverflows = 0;
+unsigned long TimerOne::captureRise = 0;
+bool TimerOne::captureStarted = false;
+volatile unsigned long TimerOne::capturePeriod = 0;
+volatile unsigned long TimerOne::captureHigh = 0;
+volatile bool TimerOne::captureFresh = false;
+
+void TimerOne::pwmInput()
+{
+  TIMSK1 &= ~TIMER1_INTERRUPTS;
+  TCCR1B = 0;
+  TCCR1A = 0;			// normal mode, outputs disconnected
+  pinMode(TIMER1_ICP_PIN, INPUT);
+  captureOverflows = 0;
+  captureStarted = false;
+  capturePeriod = 0;
+  captureHigh = 0;
+  captureFresh = false;
+  clockSelectBits = _BV(CS11);
+  pwmPeriod = 0xFFFF;
+  isrCallback = captureOverflow;
+  TCNT1 = 0;
+  TIFR1 = _BV(ICF1) | _BV(TOV1);
+  TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS11);	// noise canceler, rising edge first
+  TIMSK1 |= _BV(ICIE1) | _BV(TOIE1);
+}
+
+bool TimerOne::readPwmInput(unsigned long &periodMicroseconds, unsigned long &highMicroseconds)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned long period = capturePeriod;
+  unsigned long high = captureHigh;
+  bool fresh = captureFresh;
+  captureFresh = false;
+  SREG = oldSREG;
+  periodMicroseconds = period * 8 / (F_CPU / 1000000);
+  highMicroseconds = high * 8 / (F_CPU / 1000000);
+  return fresh;
+}
+
+void TimerOne::captureOverflow()
+{
+  captureOverflows++;
+}
+
+void TimerOne::captureIsr()
+{
+  unsigned short icr = ICR1;
+  unsigned short overflows = captureOverflows;
+  // the capture interrupt goes first, so a wrap just before the edge may
+  // still be pending: a small ICR1 then belongs after it
+  if ((TIFR1 & _BV(TOV1)) && icr < 0x8000) overflows++;
+  unsigned long stamp = ((unsigned long)overflows << 16) | icr;
+
+  if (TCCR1B & _BV(ICES1)) {
+    if (captureStarted) capturePeriod = stamp - captureRise;
+    captureRise = stamp;
+    captureStarted = true;
+    TCCR1B &= ~_BV(ICES1);
+  } else {
+    if (captureStarted) {
+      captureHigh = stamp - captureRise;
+      captureFresh = capturePeriod != 0;
+    }
+    TCCR1B |= _BV(ICES1);
+  }
+  TIFR1 = _BV(ICF1);		// changing the edge can set the flag
+}
+
+ISR(TIMER1_CAPT_vect)
+{
+  Timer1.captureIsr();
+}
+#endif
+
+#if defined(TIMERONE_COMPARE)
+unsigned char TimerOne::freeRunShift = 3;
+void (*TimerOne::compareCallback[3])() = { TimerOne::isrDefaultUnused, TimerOne::isrDefaultUnused, TimerOne::isrDefaultUnused };
+unsigned short TimerOne::comparePeriod[3] = { 0, 0, 0 };
+
+void TimerOne::freeRun(unsigned int prescale)
+{
+  TIMSK1 &= ~TIMER1_INTERRUPTS;
+  TCCR1B = 0;
+  TCCR1A = 0;			// normal mode, outputs disconnected
+  if (prescale >= 1024) { clockSelectBits = _BV(CS12) | _BV(CS10); freeRunShift = 10; }
+  else if (prescale >= 256) { clockSelectBits = _BV(CS12); freeRunShift = 8; }
+  else if (prescale >= 64) { clockSelectBits = _BV(CS11) | _BV(CS10); freeRunShift = 6; }
+  else if (prescale >= 8) { clockSelectBits = _BV(CS11); freeRunShift = 3; }
+  else { clockSelectBits = _BV(CS10); freeRunShift = 0; }
+  pwmPeriod = 0xFFFF;
+  isrCallback = isrDefaultUnused;
+  TCNT1 = 0;
+  TIFR1 = 0xFF;
+  TCCR1B = clockSelectBits;
+}
+
+void TimerOne::attachCompareInterrupt(unsigned char channel, void (*isr)(), unsigned long microseconds)
+{
+  unsigned long counts = ((F_CPU / 1000000) * microseconds) >> freeRunShift;
+  if (microseconds && counts == 0) counts = 1;
+  if (counts > 0xFFFF) counts = 0xFFFF;
+
+  detachCompareInterrupt(channel);
+  compareCallback[channel] = isr;
+  comparePeriod[channel] = counts;
+  if (counts) setCompare(channel, readCounter() + counts);
+}
+
+void TimerOne::detachCompareInterrupt(unsigned char channel)
+{
+  if (channel == COMPARE_A) TIMSK1 &= ~_BV(OCIE1A);
+  else if (channel == COMPARE_B) TIMSK1 &= ~_BV(OCIE1B);
+  #ifdef OCIE1C
+  else if (channel == COMPARE_C) TIMSK1 &= ~_BV(OCIE1C);
+  #endif
+}
+
+void TimerOne::setCompare(unsigned char channel, unsigned short counts)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  if (channel == COMPARE_A) { OCR1A = counts; TIFR1 = _BV(OCF1A); TIMSK1 |= _BV(OCIE1A); }
+  else if (channel == COMPARE_B) { OCR1B = counts; TIFR1 = _BV(OCF1B); TIMSK1 |= _BV(OCIE1B); }
+  #ifdef OCIE1C
+  else if (channel == COMPARE_C) { OCR1C = counts; TIFR1 = _BV(OCF1C); TIMSK1 |= _BV(OCIE1C); }
+  #endif
+  SREG = oldSREG;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+  TimerOne::compareIsr(TimerOne::COMPARE_A);
+}
+
+ISR(TIMER1_COMPB_vect)
+{
+  TimerOne::compareIsr(TimerOne::COMPARE_B);
+}
+
+#ifdef OCIE1C
+ISR(TIMER1_COMPC_vect)
+{
+  TimerOne::compareIsr(TimerOne::COMPARE_C);
+}
+#endif
+#endif
+#endif
+
+#if !defined (__AVR_ATtiny85__)
+// Direct digital synthesis on the TimerOne interrupt: at a fixed sample
+// rate (31.25 kHz by default, 8 bit PWM at 16 MHz) each oscillator adds its
+// 32 bit phase increment to its phase accumulator, the top 8 bits pick a
+// sample from a 256 entry waveform table, and the mix of all oscillators
+// goes out as the PWM duty. Frequencies are set in mHz; all the divisions
+// happen in setFrequency(), the interrupt only adds, multiplies and shifts.
+const unsigned char TimerOneDDS_sine[256] PROGMEM = {
+  128, 131, 134, 137, 140, 143, 146, 149, 152, 155, 158, 162, 165, 167, 170, 173,
+  176, 179, 182, 185, 188, 190, 193, 196, 198, 201, 203, 206, 208, 211, 213, 215,
+  218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 238, 240, 241, 243, 244,
+  245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+  255, 255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246,
+  245, 244, 243, 241, 240, 238, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+  218, 215, 213, 211, 208, 206, 203, 201, 198, 196, 193, 190, 188, 185, 182, 179,
+  176, 173, 170, 167, 165, 162, 158, 155, 152, 149, 146, 143, 140, 137, 134, 131,
+  128, 124, 121, 118, 115, 112, 109, 106, 103, 100,  97,  93,  90,  88,  85,  82,
+   79,  76,  73,  70,  67,  65,  62,  59,  57,  54,  52,  49,  47,  44,  42,  40,
+   37,  35,  33,  31,  29,  27,  25,  23,  21,  20,  18,  17,  15,  14,  12,  11,
+   10,   9,   7,   6,   5,   5,   4,   3,   2,   2,   1,   1,   1,   0,   0,   0,
+    0,   0,   0,   0,   1,   1,   1,   2,   2,   3,   4,   5,   5,   6,   7,   9,
+   10,  11,  12,  14,  15,  17,  18,  20,  21,  23,  25,  27,  29,  31,  33,  35,
+   37,  40,  42,  44,  47,  49,  52,  54,  57,  59,  62,  65,  67,  70,  73,  76,
+   79,  82,  85,  88,  90,  93,  97, 100, 103, 106, 109, 112, 115, 118, 121, 124,
+};
+
+class TimerOneDDS
+{
+  public:
+    static const int OSCILLATORS = 4;
+
+    // start generating on a TIMER1 pin, one sample every sampleMicroseconds
+    void begin(char pin, unsigned long sampleMicroseconds = 32) {
+	outPin = pin;
+	sampleUs = sampleMicroseconds;
+	if (!table) table = TimerOneDDS_sine;
+	Timer1.initialize(sampleMicroseconds);
+	Timer1.pwm(pin, 512);
+#if defined(__AVR__)
+	// full scale mix (OSCILLATORS * 255) to the PWM period, written
+	// straight to the compare register
+	outScale = (65536UL * Timer1.getPeriodCounts()) / (OSCILLATORS * 255UL);
+	ocr = &OCR1A;
+	#ifdef TIMER1_B_PIN
+	if (pin == TIMER1_B_PIN) ocr = &OCR1B;
+	#endif
+	#ifdef TIMER1_C_PIN
+	if (pin == TIMER1_C_PIN) ocr = &OCR1C;
+	#endif
+#else
+	// full scale mix to the 10 bit duty of setPwmDuty()
+	outScale = (65536UL * 1023) / (OSCILLATORS * 255UL);
+#endif
+	Timer1.attachInterrupt(isr);
+    }
+    void end() {
+	Timer1.detachInterrupt();
+	Timer1.disablePwm(outPin);
+    }
+
+    // 0 mHz stops the oscillator where it is
+    void setFrequency(int osc, unsigned long millihertz) {
+	if (osc < 0 || osc >= OSCILLATORS) return;
+	// f * 2^32 / sample rate
+	uint32_t inc = (unsigned long long)millihertz * sampleUs * 4294967296ULL / 1000000000ULL;
+	noInterrupts();
+	increment[osc] = inc;
+	interrupts();
+    }
+    // 0 (silent) to 255 (full scale)
+    void setAmplitude(int osc, unsigned char a) {
+	if (osc < 0 || osc >= OSCILLATORS) return;
+	amplitude[osc] = a;
+    }
+    // 256 unsigned samples in PROGMEM, TimerOneDDS_sine by default
+    void setWaveform(const unsigned char *t) {
+	table = t;
+    }
+
+  private:
+    static void isr();
+
+    static const unsigned char *table;
+    static uint32_t phase[OSCILLATORS];
+    static volatile uint32_t increment[OSCILLATORS];
+    static volatile unsigned char amplitude[OSCILLATORS];
+    static unsigned long outScale;
+    static unsigned long sampleUs;
+    static char outPin;
+#if defined(__AVR__)
+    static volatile uint16_t *ocr;
+#endif
+};
+
+const unsigned char *TimerOneDDS::table = 0;
+uint32_t TimerOneDDS::phase[TimerOneDDS::OSCILLATORS];
+volatile uint32_t TimerOneDDS::increment[TimerOneDDS::OSCILLATORS];
+volatile unsigned char TimerOneDDS::amplitude[TimerOneDDS::OSCILLATORS];
+unsigned long TimerOneDDS::outScale;
+unsigned long TimerOneDDS::sampleUs;
+char TimerOneDDS::outPin;
+#if defined(__AVR__)
+volatile uint16_t *TimerOneDDS::ocr;
+#endif
+
+void TimerOneDDS::isr()
+{
+  unsigned int mix = 0;
+  for (int i = 0; i < OSCILLATORS; i++) {
+    phase[i] += increment[i];
+    mix += ((unsigned int)pgm_read_byte(table + (phase[i] >> 24)) * amplitude[i]) >> 8;
+  }
+  unsigned int duty = ((unsigned long)mix * outScale) >> 16;
+#if defined(__AVR__)
+  *ocr = duty;
+#else
+  Timer1.setPwmDuty(outPin, duty);
+#endif
+}
+#endif
+
+// Infrared transmitter: TimerOne generates the carrier in hardware and
+// Timer2 (CTC, 4 us ticks at 16 MHz) times the marks and spaces of a frame
+// from its compare interrupt, connecting and disconnecting the carrier
+// output at each edge, so send() returns at once and the frame goes out in
+// the background. Only built with TIMERONE_IR defined: it owns Timer2 and
+// defines TIMER2_COMPA_vect, so it can't be linked together with tone(),
+// MsTimer2 or IR receiver libraries that use Timer2.
+#if defined(TIMERONE_IR)
+#if !(defined(__AVR__) && defined(TIMSK2) && defined(OCIE2A))
+#error TIMERONE_IR needs an AVR with Timer2
+#endif
+class TimerOneIR
+{
+  public:
+    // carrier on a TIMER1 pin, 1/3 duty
+    void begin(char pin, unsigned int khz = 38) {
+	pinMode(pin, OUTPUT);
+	digitalWrite(pin, LOW);
+	Timer1.initialize((1000 + khz / 2) / khz);
+	Timer1.pwm(pin, 341);
+	com = _BV(COM1A1);
+	#ifdef TIMER1_B_PIN
+	if (pin == TIMER1_B_PIN) com = _BV(COM1B1);
+	#endif
+	#ifdef TIMER1_C_PIN
+	if (pin == TIMER1_C_PIN) com = _BV(COM1C1);
+	#endif
+	TCCR1A &= ~com;			// carrier off until a mark
+
+	TIMSK2 = 0;
+	ASSR &= ~_BV(AS2);
+	TCCR2A = _BV(WGM21);		// CTC
+	TCCR2B = 0;			// stopped
+    }
+
+    // send durations[0..count-1] in microseconds, alternately mark and
+    // space, starting with a mark; the table has to stay around until
+    // busy() returns false. Returns false if a frame is still going out
+    bool send(const unsigned int *durations, unsigned char count) {
+	if (sending || count == 0) return false;
+	frame = durations;
+	length = count;
+	index = 0;
+	sending = true;
+	TCCR1A |= com;			// first mark
+	load(frame[0]);
+	TCNT2 = 0;
+	TIFR2 = _BV(OCF2A);
+	TIMSK2 = _BV(OCIE2A);
+	TCCR2B = _BV(CS22);		// clk/64
+	return true;
+    }
+    bool busy() { return sending; }
+
+    static void gate();
+
+  private:
+    // start timing us microseconds, in chunks of up to 256 Timer2 ticks
+    static void load(unsigned int us) {
+	unsigned long ticks = ((unsigned long)us * (F_CPU / 64000UL)) / 1000;
+	left = ticks ? ticks : 1;
+	next();
+    }
+    static void next() {
+	unsigned int chunk = left > 256 ? 256 : left;
+	left -= chunk;
+	OCR2A = chunk - 1;
+    }
+
+    static const unsigned int *frame;
+    static unsigned char length;
+    static volatile unsigned char index;
+    static volatile bool sending;
+    static unsigned long left;		// Timer2 ticks left in the current mark/space
+    static unsigned char com;		// COM1x1 bit of the carrier pin
+};
+
+const unsigned int *TimerOneIR::frame;
+unsigned char TimerOneIR::length;
+volatile unsigned char TimerOneIR::index;
+volatile bool TimerOneIR::sending = false;
+unsigned long TimerOneIR::left;
+unsigned char TimerOneIR::com;
+
+// end of a chunk: carry on with the current mark/space or flip to the next
+void TimerOneIR::gate()
+{
+  if (left) {
+    next();
+    return;
+  }
+  if (++index >= length) {
+    TCCR1A &= ~com;
+    TCCR2B = 0;
+    TIMSK2 = 0;
+    sending = false;
+    return;
+  }
+  if (index & 1) TCCR1A &= ~com;	// space
+  else TCCR1A |= com;			// mark
+  load(frame[index]);
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  TimerOneIR::gate();
+}
+#endif
+
+#if defined(__AVR__) && !defined (__AVR_ATtiny85__) && defined(TIMERONE_COMPARE)
+// Microsecond one-shots on a free-running Timer1: the pending deadlines
+// are kept sorted and compare channel B is always set to the earliest, so
+// there is an interrupt only when a callback is due. Timer1 counts at clk/8
+// (0.5 us at 16 MHz) and its overflows extend the count to 32 bits; a
+// deadline more than one wrap away is armed from the overflow interrupt
+// once it comes within reach. Callbacks run in interrupt context. Takes
+// Timer1 over, leaving compare channels A and C to freeRun() users. Built
+// on the compare channels, so only with TIMERONE_COMPARE defined.
+class TimerOneQueue
+{
+  public:
+    static const unsigned char SLOTS = 8;
+
+    void begin() {
+	Timer1.freeRun(8);
+	high = 0;
+	count = 0;
+	armed = false;
+	for (unsigned char i = 0; i < SLOTS; i++) callback[i] = 0;
+	Timer1.attachCompareInterrupt(TimerOne::COMPARE_B, fire, 0);
+	Timer1.attachInterrupt(overflow);
+    }
+
+    // call f once, microseconds from now (up to about 17 minutes at
+    // 16 MHz); returns the slot for cancel(), or -1 if all are pending
+    char schedule(void (*f)(), unsigned long microseconds);
+    // drop a pending one-shot; false if it already ran
+    bool cancel(char slot);
+    unsigned char pending() { return count; }
+
+    // 32 bit timer count, F_CPU / 8 per second
+    static unsigned long now();
+
+  private:
+    static void fire();
+    static void overflow();
+    static void arm();
+    static void remove(unsigned char position);
+
+    static volatile unsigned short high;	// Timer1 overflows, the upper half of now()
+    static unsigned long deadline[SLOTS];
+    static void (*callback[SLOTS])();		// 0 for a free slot
+    static unsigned char order[SLOTS];		// pending slots, earliest first
+    static volatile unsigned char count;
+    static bool armed;				// compare B is set to order[0]
+};
+
+volatile unsigned short TimerOneQueue::high = 0;
+unsigned long TimerOneQueue::deadline[TimerOneQueue::SLOTS];
+void (*TimerOneQueue::callback[TimerOneQueue::SLOTS])();
+unsigned char TimerOneQueue::order[TimerOneQueue::SLOTS];
+volatile unsigned char TimerOneQueue::count = 0;
+bool TimerOneQueue::armed = false;
+
+unsigned long TimerOneQueue::now()
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned short h = high;
+  unsigned short t = TCNT1;
+  // a wrap whose interrupt hasn't run yet
+  if ((TIFR1 & _BV(TOV1)) && t < 0x8000) h++;
+  SREG = oldSREG;
+  return ((unsigned long)h << 16) | t;
+}
+
+char TimerOneQueue::schedule(void (*f)(), unsigned long microseconds)
+{
+  unsigned long ticks = (microseconds >> 3) * (F_CPU / 1000000) + (((microseconds & 7) * (F_CPU / 1000000)) >> 3);
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned char slot = 0;
+  while (slot < SLOTS && callback[slot]) slot++;
+  if (slot < SLOTS) {
+    unsigned long due = now() + ticks;
+    deadline[slot] = due;
+    callback[slot] = f;
+    unsigned char i = count;
+    while (i > 0 && (long)(deadline[order[i - 1]] - due) > 0) {
+      order[i] = order[i - 1];
+      i--;
+    }
+    order[i] = slot;
+    count++;
+    if (i == 0) arm();
+  }
+  SREG = oldSREG;
+  return slot < SLOTS ? slot : -1;
+}
+
+bool TimerOneQueue::cancel(char slot)
+{
+  bool found = false;
+  uint8_t oldSREG = SREG;
+  cli();
+  for (unsigned char i = 0; i < count; i++) {
+    if (order[i] == slot) {
+      remove(i);
+      if (i == 0) arm();
+      found = true;
+      break;
+    }
+  }
+  SREG = oldSREG;
+  return found;
+}
+
+void TimerOneQueue::remove(unsigned char position)
+{
+  callback[order[position]] = 0;
+  count--;
+  for (unsigned char i = position; i < count; i++) order[i] = order[i + 1];
+}
+
+// set compare B to the earliest deadline if it is within one wrap
+void TimerOneQueue::arm()
+{
+  armed = false;
+  if (!count) {
+    Timer1.detachCompareInterrupt(TimerOne::COMPARE_B);
+    return;
+  }
+  unsigned long due = deadline[order[0]];
+  unsigned long t = now();
+  long left = due - t;
+  if (left >= 0x10000L) {
+    Timer1.detachCompareInterrupt(TimerOne::COMPARE_B);
+    return;
+  }
+  if (left < 8) due = t + 8;	// too close for the compare to catch
+  Timer1.setCompare(TimerOne::COMPARE_B, due);
+  armed = true;
+}
+
+void TimerOneQueue::fire()
+{
+  while (count && (long)(deadline[order[0]] - now()) <= 0) {
+    void (*f)() = callback[order[0]];
+    remove(0);
+    f();
+  }
+  arm();
+}
+
+void TimerOneQueue::overflow()
+{
+  high++;
+  if (count && !armed) arm();
+}
+#endif
+
+#if defined(__arm__) && defined(TEENSYDUINO) && defined(__IMXRT1062__)
+// 32 bit counter from cascaded QuadTimer channels at the full bus clock:
+// TMR4 channel 1 counts the roll overs of channel 0, so periods up to 2^32
+// bus clocks (28.6 s at 150 MHz) keep single count resolution and read()
+// gives 32 bit timestamps. Channel 2 counts in lockstep with channel 0 and
+// carries the compare for the low half, channel 1 the one for the high
+// half, so a period costs one or two interrupts however long it is, with
+// no overflow counting in software.
+class TimerOneCascade
+{
+  public:
+    void initialize(unsigned long microseconds = 1000000) {
+	CCM_CCGR6 |= CCM_CCGR6_QTIMER4(CCM_CCGR_ON);
+	TMR4_ENBL = 0;
+	TMR4_CTRL0 = 0;
+	TMR4_CTRL1 = 0;
+	TMR4_CTRL2 = 0;
+	TMR4_SCTRL0 = 0;
+	TMR4_SCTRL1 = 0;
+	TMR4_SCTRL2 = 0;
+	TMR4_CSCTRL0 = 0;
+	TMR4_CSCTRL1 = 0;
+	TMR4_CSCTRL2 = 0;
+	TMR4_LOAD0 = 0;
+	TMR4_LOAD1 = 0;
+	TMR4_LOAD2 = 0;
+	TMR4_CNTR0 = 0;
+	TMR4_CNTR1 = 0;
+	TMR4_CNTR2 = 0;
+	TMR4_COMP10 = 0xFFFF;		// compare with the roll over the cascade counts
+	TMR4_CMPLD10 = 0xFFFF;
+	TMR4_CTRL1 = TMR_CTRL_CM(7) | TMR_CTRL_PCS(4);	// cascaded on channel 0
+	TMR4_CTRL0 = TMR_CTRL_CM(1) | TMR_CTRL_PCS(8);	// IP bus clock
+	TMR4_CTRL2 = TMR_CTRL_CM(1) | TMR_CTRL_PCS(8);
+	TMR4_ENBL = 7;			// start together
+	setPeriod(microseconds);
+    }
+    void setPeriod(unsigned long microseconds) {
+	unsigned long long counts = (unsigned long long)F_BUS_ACTUAL * microseconds / 1000000;
+	setPeriodCounts(counts > 0xFFFFFFFF ? 0xFFFFFFFF : counts);
+    }
+    // at least 1000 counts, so an interrupt is never due before it is set up
+    void setPeriodCounts(uint32_t counts) {
+	period = counts < 1000 ? 1000 : counts;
+    }
+
+    void attachInterrupt(void (*isr)()) {
+	__disable_irq();
+	callback = isr;
+	target = read() + period;
+	arm();
+	__enable_irq();
+	attachInterruptVector(IRQ_QTIMER4, irq);
+	NVIC_ENABLE_IRQ(IRQ_QTIMER4);
+    }
+    void attachInterrupt(void (*isr)(), unsigned long microseconds) {
+	if (microseconds > 0) setPeriod(microseconds);
+	attachInterrupt(isr);
+    }
+    void detachInterrupt() {
+	NVIC_DISABLE_IRQ(IRQ_QTIMER4);
+	TMR4_CSCTRL1 = 0;
+	TMR4_CSCTRL2 = 0;
+    }
+
+    // 32 bit timestamp, F_BUS_ACTUAL counts per second. Reading channel 0
+    // latches channel 1 into its hold register, so the halves match
+    static uint32_t read() {
+	uint32_t primask;
+	__asm__ volatile("mrs %0, primask\n" : "=r" (primask)::);
+	__disable_irq();
+	uint16_t low = TMR4_CNTR0;
+	uint16_t high = TMR4_HOLD1;
+	if (!primask) __enable_irq();
+	return ((uint32_t)high << 16) | low;
+    }
+
+  private:
+    // wait for the high half of target, or once it is there the low half
+    static void arm() {
+	uint32_t now = read();
+	if ((uint16_t)(target >> 16) != (uint16_t)(now >> 16)) {
+		TMR4_CSCTRL2 = 0;
+		TMR4_COMP11 = target >> 16;
+		TMR4_CSCTRL1 = TMR_CSCTRL_TCF1EN;
+	} else {
+		TMR4_CSCTRL1 = 0;
+		TMR4_COMP12 = target;
+		TMR4_CSCTRL2 = TMR_CSCTRL_TCF1EN;
+	}
+    }
+    static void irq();
+
+    static void (*callback)();
+    static uint32_t period;
+    static uint32_t target;		// read() value of the next interrupt
+};
+
+void (*TimerOneCascade::callback)();
+uint32_t TimerOneCascade::period = 1000;
+uint32_t TimerOneCascade::target = 0;
+
+void TimerOneCascade::irq()
+{
+  TMR4_CSCTRL1 = 0;
+  TMR4_CSCTRL2 = 0;
+  for (;;) {
+    // far enough out for a compare: set it up and wait for it
+    if ((int32_t)(target - read()) > 64) {
+      arm();
+      break;
+    }
+    // the last few counts are spun out, then the next period starts
+    while ((int32_t)(target - read()) > 0) ;
+    target += period;
+    callback();
+  }
+  asm("dsb");
+}
+#endif
+
 ////////////////////////////////////
 
 void setup() {